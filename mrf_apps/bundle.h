@@ -0,0 +1,118 @@
+/*
+ * file: bundle.h
+ *
+ * Esri compact cache V2 bundle structures
+ *
+ * A bundle holds up to 128x128 tiles. It starts with a 64 byte header, followed by the
+ * tile index, 16384 entries of 64 bits. Each entry holds the tile offset in the low 40 bits
+ * and the tile size in the high 24 bits, a zero size means the tile is not present.
+ * In the data area, each tile is prefixed by its size, as four bytes. The offset in the
+ * index points to the first byte of the tile, after the size prefix.
+ * All values are little endian.
+ *
+ */
+
+#if !defined(BUNDLE_H)
+#define BUNDLE_H
+
+#include <cstdint>
+#include <string>
+
+#if defined(_WIN32)
+// Windows is always little endian
+#if !defined(le64toh)
+#define htole32(x) (x)
+#define le32toh(x) (x)
+#define htole64(x) (x)
+#define le64toh(x) (x)
+#endif
+#else
+#include <endian.h>
+#endif
+
+namespace bundle {
+
+// Tiles per side
+const int BSZ = 128;
+const int BSZ2 = BSZ * BSZ;
+const int VERSION = 3;
+// Header and index sizes, the tiles follow
+const int HDRSZ = 64;
+const int IDXSZ = BSZ2 * 8;
+
+} // namespace bundle
+
+// The bundle header, in host order after toh()
+struct bundle_header {
+    uint32_t version;            // 3
+    uint32_t records;            // Index entries, 16384
+    uint32_t max_record;         // Largest tile size
+    uint32_t offset_size;        // Bytes of the index entry used for the offset, 5
+    uint64_t slack;
+    uint64_t file_size;
+    uint64_t user_header_offset; // 40
+    uint32_t user_header_size;   // Legacy fields and the index
+    uint32_t legacy[4];
+    uint32_t index_size;         // In bytes, 131072
+
+    void toh() {
+        version = le32toh(version);
+        records = le32toh(records);
+        max_record = le32toh(max_record);
+        offset_size = le32toh(offset_size);
+        slack = le64toh(slack);
+        file_size = le64toh(file_size);
+        user_header_offset = le64toh(user_header_offset);
+        user_header_size = le32toh(user_header_size);
+        for (auto &v : legacy)
+            v = le32toh(v);
+        index_size = le32toh(index_size);
+    }
+    void tole() {
+        version = htole32(version);
+        records = htole32(records);
+        max_record = htole32(max_record);
+        offset_size = htole32(offset_size);
+        slack = htole64(slack);
+        file_size = htole64(file_size);
+        user_header_offset = htole64(user_header_offset);
+        user_header_size = htole32(user_header_size);
+        for (auto &v : legacy)
+            v = htole32(v);
+        index_size = htole32(index_size);
+    }
+
+    // Returns an error message, or empty if the header is usable for a file of this size
+    std::string check(uint64_t size) const {
+        if (size < bundle::HDRSZ + bundle::IDXSZ)
+            return "Input file too small, can't be a bundle";
+        if (version != bundle::VERSION)
+            return "Not an esri V2 bundle, wrong version";
+        return std::string();
+    }
+};
+
+static_assert(sizeof(bundle_header) == bundle::HDRSZ, "Bundle header is 64 bytes");
+
+// A bundle index entry, stored little endian
+struct bundle_index {
+    static const uint64_t OFFSET_MASK = (1ULL << 40) - 1;
+    static const uint64_t MAX_SIZE = (1ULL << 24) - 1;
+
+    uint64_t offset() const {
+        return le64toh(value) & OFFSET_MASK;
+    }
+    uint64_t size() const {
+        return le64toh(value) >> 40;
+    }
+    // Both have to fit, the offset in 40 bits and the size in 24
+    void set(uint64_t offset, uint64_t size) {
+        value = htole64((size << 40) | (offset & OFFSET_MASK));
+    }
+
+    uint64_t value;
+};
+
+static_assert(sizeof(bundle_index) * bundle::BSZ2 == bundle::IDXSZ, "Bundle index entries are 8 bytes");
+
+#endif
@@ -35,35 +35,26 @@
  * It is recommended to cache content within the bitmap, to reduce or eliminate the cost associated
  * with reading from the bitmap
  *
+ * Optionally, with -s, a summary of the bitmap follows the last data block, so a reader can
+ * find which parts of the bitmap are in use without reading all of it. The summary has one
+ * 32bit big endian value for every group of 4096 bitmap lines, then the total number of data
+ * blocks, also 32bit big endian, then a 16 byte footer line, which ends the file
+ * | "IXS\0" | lines per group, 4096 | number of groups, 64bit |
+ * Each value is the running count of the first line in the group. A group which has the same
+ * count as the next one, or as the total for the last group, has no bits set. The number of
+ * groups is known from the header, so a reader gets the whole summary by reading that many
+ * bytes from the end of the file. Readers that don't use the summary, such as uncan, ignore it
+ *
  */
 
 #if defined(_WIN32)
 #define _CRT_SECURE_NO_WARNINGS
-#include <Windows.h>
-#include <io.h>
-
-#define FSEEK _fseeki64
-#define FTELL _ftelli64
-
- // Windows is always little endian, supply functions to swap bytes
- // These are defined in <cstdlib>
-#define htobe16 _byteswap_ushort
-#define be16toh _byteswap_ushort
-#define htobe32 _byteswap_ulong
-#define be32toh _byteswap_ulong
-#define htobe64 _byteswap_uint64
-#define be64toh _byteswap_uint64
-
-#else
-#include <unistd.h>
-#include <endian.h>
-#define FSEEK fseek
-#define FTELL ftell
-
-#define SETSPARSE(f) {}
-
+#include <fcntl.h>
 #endif
 
+// Index structures, platform file helpers
+#include "mrf_index.h"
+
 #include <string>
 #include <vector>
 #include <algorithm>
@@ -72,10 +63,32 @@
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
+#include <cerrno>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+// Byte sources, for reading canned files from files, streams or URLs
+#include "canned_index.h"
 
  // For memset only
 #include <cstring>
 
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#define HAVE_AVX2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
+
 using namespace std;
 
 // Error codes
@@ -83,31 +96,13 @@ enum { NO_ERR = 0, USAGE_ERR, IO_ERR, INTERNAL_ERR };
 
 // Block size used, do not modify
 const int BSZ = 512;
+// Blocks read at once, 4MB
+const size_t BATCH = 8192;
 // 4 byte length signature string
 const char *SIG = "IDX";
-
-// Make file end at current offset, return true on success
-static bool MARK_END(FILE *f) {
-#if defined(_WIN32)
-    HANDLE h = (HANDLE) _get_osfhandle(_fileno(f));
-    if (h == INVALID_HANDLE_VALUE)
-        return false; // Possibly not a seekable file
-    return 0 != SetEndOfFile(h);
-#else
-    return !ftruncate(fileno(f), ftell(f));
-#endif
-}
-
-#if defined(_WIN32)
-// Set file as sparse, returns true if all went fine
-static bool SETSPARSE(FILE *f) {
-    DWORD dw;
-    HANDLE h = (HANDLE)_get_osfhandle(_fileno(f));
-    if (INVALID_HANDLE_VALUE == h)
-        return false;
-    return 0 != DeviceIoControl(h, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &dw, nullptr);
-}
-#endif
+// Summary signature and group size
+const char *SUM_SIG = "IXS";
+const size_t GROUP_LINES = 4096;
 
 // Compare a substring of src with cmp, return true if same
 // offset can be negative, in which case it is measured from the end of the src, python style
@@ -130,14 +125,74 @@ inline bool check(const char *src, size_t len = BSZ) {
     return 0 == accumulator;
 }
 
+#if defined(HAVE_AVX2)
+TARGET_AVX2 static bool check_avx2(const char *src) {
+    const __m256i *p = reinterpret_cast<const __m256i *>(src);
+    __m256i accumulator = _mm256_loadu_si256(p);
+    for (int i = 1; i < BSZ / 32; i++)
+        accumulator = _mm256_or_si256(accumulator, _mm256_loadu_si256(p + i));
+    return 0 != _mm256_testz_si256(accumulator, accumulator);
+}
+
+static bool has_avx2() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    // OSXSAVE, then check that the OS saves the YMM registers
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return 0 != (info[1] & (1 << 5));
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#if defined(HAVE_NEON)
+static bool check_neon(const char *src) {
+    const uint64_t *p = reinterpret_cast<const uint64_t *>(src);
+    uint64x2_t accumulator = vld1q_u64(p);
+    for (int i = 2; i < BSZ / 8; i += 2)
+        accumulator = vorrq_u64(accumulator, vld1q_u64(p + i));
+    return 0 == (vgetq_lane_u64(accumulator, 0) | vgetq_lane_u64(accumulator, 1));
+}
+#endif
+
+static bool check_block(const char *src) {
+    return check(src);
+}
+
+// Pick the zero check for a full block, once
+static bool (*select_check())(const char *) {
+#if defined(HAVE_AVX2)
+    if (has_avx2())
+        return check_avx2;
+#elif defined(HAVE_NEON)
+    return check_neon;
+#endif
+    return check_block;
+}
+
+static bool (* const check_full)(const char *) = select_check();
+
+// Sets empty[i] for every full block in src that is filled with zeros
+static void scan_blocks(const char *src, size_t blocks, vector<uint8_t> &empty) {
+    for (size_t i = 0; i < blocks; i++)
+        empty[i] = check_full(src + i * BSZ);
+}
+
 // Program options
 struct options {
-    options() : un(false), quiet(false) {}
+    options() : un(false), generic(false), quiet(false), summary(false), threads(1) {}
     vector<string> file_names;
+    string manifest; // File with input and output name pairs
     string error; // Empty if parsing went fine
     bool un;      // uncanning
     bool generic; // generic file, skip index structure checks
     bool quiet;   // Verbose by default
+    bool summary; // Add the bitmap summary when canning
+    int threads;  // Files processed at the same time, 0 for all cores
 };
 
 static options parse(int argc, char **argv) {
@@ -160,9 +215,26 @@ static options parse(int argc, char **argv) {
                 opt.un = true;
                 continue;
             }
+            else if (arg == "-s") {
+                opt.summary = true;
+            }
             else if (arg == "-g") {
                 opt.generic = true;
             }
+            else if (arg == "-j" || arg == "-l") {
+                if (++i == argc) {
+                    opt.error = arg + " needs a value";
+                    return opt;
+                }
+                if (arg == "-l")
+                    opt.manifest = argv[i];
+                else
+                    opt.threads = atoi(argv[i]);
+                if (opt.threads < 0) {
+                    opt.error = "Invalid thread count";
+                    return opt;
+                }
+            }
             else if (arg == "-") { // Could be stdin or stdout file name
                 opt.file_names.push_back(arg);
             }
@@ -188,13 +260,21 @@ static options parse(int argc, char **argv) {
 
 static int Usage(const string &error) {
     cerr << error << endl;
-    cerr << "can [-u] [-g] [-q] [-h] [--] input_file output_file" << endl;
+    cerr << "can [-u] [-g] [-q] [-s] [-j N] [-l list] [-h] [--] input_file output_file ..." << endl;
     cerr << "\t-u : uncan" << endl;
+    cerr << "\t-s : add a bitmap summary when canning, for readers that don't load the whole bitmap" << endl;
     cerr << "\t-g : generic input, not necessarily an mrf index file" << endl;
+    cerr << "\t-q : quiet, no messages" << endl;
+    cerr << "\t-j : process N files at the same time, 0 for all cores, default 1" << endl;
+    cerr << "\t-l : list file, with one input and output file name pair per line" << endl;
     cerr << "\t-h : help, print this message" << endl;
     cerr << "\t-- : end of options, only file names follow" << endl;
     cerr << "\t   : file name should have .idx extension for canning and .ix for uncanning, except if -g option is used" << endl;
-    cerr << "\t     Use - for stdin or stdout" << endl;
+    cerr << "\t     Use - for stdout when canning or for stdin when uncanning" << endl;
+#if defined(HAVE_CURL)
+    cerr << "\t     When uncanning, the input can also be an http(s):// or s3:// URL" << endl;
+#endif
+    cerr << "\t     More than one pair of file names can be given, a summary is printed at the end" << endl;
     return USAGE_ERR;
 }
 
@@ -203,24 +283,25 @@ static inline uint64_t hsize(uint64_t in_size) {
     return 16 + 16 * ((96 * BSZ - 1 + in_size) / (96 * BSZ));
 }
 
-// transfer len bytes from in to out, at the current positions
-// prints an error and returns false if errors are encountered
-// len has to be under or equal to BSZ, since a static buffer is used
-inline int transfer(FILE *in_file, FILE *out_file, size_t len = BSZ) {
-    assert(len <= BSZ);
-    static char buffer[BSZ];
-
-    if (len != fread(buffer, 1, len, in_file)) {
-        cerr << "Read error\n";
-        return false;
-    }
+// transfer len bytes from in at in_pos to out at the current position, advances in_pos
+// Returns an error message, or empty on success
+// The buffer is used as staging, so len can be larger than the buffer
+inline string transfer(canned::byte_source &in, uint64_t &in_pos, FILE *out_file, uint64_t len,
+    vector<char> &buffer)
+{
+    while (len) {
+        size_t sz = static_cast<size_t>(min<uint64_t>(len, buffer.size()));
+        if (!in.read_all(in_pos, sz, buffer.data())) {
+            return "Read error";
+        }
+        in_pos += sz;
+        len -= sz;
 
-    if (len != fwrite(buffer, 1, len, out_file)) {
-        cerr << "Write error\n";
-        return false;
+        if (sz != fwrite(buffer.data(), 1, sz, out_file)) {
+            return "Write error";
+        }
     }
-
-    return true;
+    return string();
 }
 
 // The bit state at a given position in a line, assumes native endianess
@@ -228,124 +309,175 @@ inline bool is_on(uint32_t *values, int bit) {
     return 0 != (values[1 + bit / 32] & (static_cast<uint32_t>(1) << bit % 32));
 }
 
-int can(const options &opt) {
-    if (opt.file_names.size() != 2)
-        return Usage("Need an input and an output name");
+// Builds the canned bitmap in the header, one input block at a time
+class bitmap_builder {
+public:
+    bitmap_builder(vector<uint32_t> &header) : count(0), header(header), line(4), bit_pos(0) {}
 
-    string in_idx_name(opt.file_names[0]);
-    string out_idx_name(opt.file_names[1]);
-
-    if (!opt.generic) {
-        if (!substr_equal(in_idx_name, ".idx", -4))
-            return Usage("Input file should have an .idx extension");
-
-        if (!substr_equal(out_idx_name, ".ix", -3))
-            return Usage("Output file should have an .ix extension");
+    // Record the state of the next input block
+    void add(bool present) {
+        if (present) {
+            header[line + 1 + bit_pos / 32] |= static_cast<uint32_t>(1) << (bit_pos % 32);
+            count++;
+        }
+        if (96 == ++bit_pos)
+            next_line();
     }
 
-    FILE *in_idx = fopen(in_idx_name.c_str(), "rb");
-    FILE *out_idx = fopen(out_idx_name.c_str(), "wb");
-
-    if (!in_idx || !out_idx) {
-        cerr << "Error opening " << (in_idx ? out_idx_name : in_idx_name) << endl;
-        return IO_ERR;
+    // Record a number of empty blocks
+    void skip(uint64_t blocks) {
+        while (blocks && bit_pos)
+            add(false), blocks--;
+        for (; blocks >= 96; blocks -= 96)
+            next_line();
+        while (blocks--)
+            add(false);
     }
 
-    FSEEK(in_idx, 0, SEEK_END);
-    uint64_t in_size = static_cast<uint64_t>(FTELL(in_idx));
-    FSEEK(in_idx, 0, SEEK_SET);
-
-    // Input has to be an index, which is always a multiple of 16 bytes
-    if ( (!opt.generic) && in_size % 16) {
-        cerr << "Input file is not an index file, size is not a multiple of 16\n";
-        return USAGE_ERR;
+    // The very last block, which may be partial but it always exists
+    void add_last(bool present) {
+        if (present)
+            header[line + 1 + bit_pos / 32] |= static_cast<uint32_t>(1) << (bit_pos % 32);
+        line += 4; // Points to the header end
     }
 
-    uint64_t header_size = hsize(in_size);
-    if (!opt.quiet)
-        cout << "Header will be " << header_size << " bytes" << endl;
-
-    // Get space for the header and reserve space on disk,
-    // Header will be written at the end
-    vector<uint32_t> header(header_size / sizeof(uint32_t));
-
-    // Reserve space for the header
-    fwrite(header.data(), sizeof(uint32_t), header.size(), out_idx);
-
     // Running count of output blocks
-    size_t count = 0;
-    size_t in_block_count = (BSZ - 1 + in_size) / BSZ;
-    // Block buffer
-    char buffer[BSZ];
+    size_t count;
+    // Line past the last one recorded, as a 32bit int index
+    size_t end() const { return line; }
+
+private:
+    void next_line() {
+        // Start a new line, store the running count
+        bit_pos = 0;
+        // If there are no set bits, mark the line
+        // This allows for efficient caching of canned index
+        // since every double block will contain non-zero bytes
+        if (count == 0)
+            header[line] = *reinterpret_cast<const uint32_t *>(SIG);
+        line += 4;
+        // If there is another line, initialize running count
+        if (line < header.size())
+            header[line] = static_cast<uint32_t>(count);
+    }
 
+    vector<uint32_t> &header;
     // Current line start within header as a 32bit int index
     // always a multiple of 4, since there are 4 ints per line
-    // Skip the reserved line
-    int line = 4;
+    size_t line;
     // and current bit position within that line
-    int bit_pos = 0;
+    int bit_pos;
+};
 
-#define BIT_SET(line, i) header[line + 1 + i / 32] |= 1 << (i % 32)
+// Closes the file when going out of scope, except for stdin and stdout
+// Many files are processed by the same process, every exit path has to close them
+struct file_guard {
+    explicit file_guard(FILE *f) : f(f) {}
+    ~file_guard() { close(); }
+    // Returns non-zero on error, like fclose
+    int close() {
+        int result = 0;
+        if (f && f != stdin && f != stdout)
+            result = fclose(f);
+        f = nullptr;
+        return result;
+    }
+private:
+    FILE *f;
+    file_guard(const file_guard &) = delete;
+    file_guard &operator=(const file_guard &) = delete;
+};
 
-    // Check all full blocks, transferring them as needed
-    while (--in_block_count) {
-        if (BSZ != fread(buffer, 1, BSZ, in_idx)) {
-            cerr << "Error reading block from input file\n";
-            return IO_ERR;
-        }
+// Buffers that are reused from one file to the next, one set per worker thread
+struct workspace {
+    workspace() : buffer(BATCH * BSZ), empty(BATCH), read(0), written(0) {}
+    vector<uint32_t> header;
+    vector<uint32_t> summary;
+    vector<char> buffer;
+    vector<uint8_t> empty;
+    // Bytes read and written, accumulated over all files
+    uint64_t read;
+    uint64_t written;
+};
 
-        if (!check(buffer)) {
-            if (BSZ != fwrite(buffer, 1, BSZ, out_idx)) {
-                cerr << "Error writing to output file\n";
-                return IO_ERR;
+// Scans the input index, recording the state of every block in the bitmap
+// When out_idx is not null, the blocks with content are also written to it
+// Returns an error message, or empty on success
+static string scan_index(FILE *in_idx, uint64_t in_size, bitmap_builder &bitmap, FILE *out_idx,
+    workspace &ws)
+{
+    uint64_t in_block_count = (BSZ - 1 + in_size) / BSZ;
+
+    // Check all full blocks, a batch at a time,
+    // transferring the runs of blocks with content as needed
+    auto &buffer = ws.buffer;
+    auto &empty = ws.empty;
+    uint64_t full_blocks = in_block_count ? in_block_count - 1 : 0;
+
+    // Only the allocated parts of the input need to be read, holes are empty
+    uint64_t block = 0; // Next block to record
+    for (auto &range : allocated_ranges(in_idx, in_size)) {
+        uint64_t first = max(block, range.start / BSZ);
+        uint64_t last = min(full_blocks, (range.end + BSZ - 1) / BSZ);
+        if (first >= last)
+            continue;
+        bitmap.skip(first - block);
+        // Always seek, looking for holes moves the file descriptor
+        FSEEK(in_idx, first * BSZ, SEEK_SET);
+
+        for (block = first; block < last;) {
+            size_t blocks = static_cast<size_t>(min<uint64_t>(last - block, BATCH));
+            if (blocks != fread(buffer.data(), BSZ, blocks, in_idx)) {
+                return "Error reading block from input file";
             }
-            BIT_SET(line, bit_pos);
-            count++;
-        }
-
-        bit_pos++;
-        if (96 == bit_pos) {
-            // Start a new line, store the running count
-            bit_pos = 0;
-            // If there are no set bits, mark the line
-            // This allows for efficient caching of canned index
-            // since every double block will contain non-zero bytes
-            if (count == 0)
-                header[line] = *reinterpret_cast<const uint32_t *>(SIG);
-            line += 4;
-            // If there is another line, initialize running count
-            if (line < header.size())
-                header[line] = static_cast<uint32_t>(count);
+            ws.read += blocks * BSZ;
+            scan_blocks(buffer.data(), blocks, empty);
+
+            for (size_t i = 0; i < blocks;) {
+                if (empty[i]) {
+                    bitmap.add(false);
+                    i++;
+                    continue;
+                }
+                size_t run = i;
+                while (run < blocks && !empty[run])
+                    bitmap.add(true), run++;
+                if (out_idx) {
+                    if (run - i != fwrite(&buffer[i * BSZ], BSZ, run - i, out_idx)) {
+                        return "Error writing to output file";
+                    }
+                    ws.written += (run - i) * BSZ;
+                }
+                i = run;
+            }
+            block += blocks;
         }
     }
+    bitmap.skip(full_blocks - block);
+    FSEEK(in_idx, full_blocks * BSZ, SEEK_SET);
 
     auto extra_bytes = (in_size % BSZ) ? (in_size % BSZ) : BSZ;
 
     // The very last block may be partial, but it always exists
-    memset(buffer, 0, BSZ);
-    if (extra_bytes != fread(buffer, 1, extra_bytes, in_idx)) {
-        cerr << "Error reading block from input file\n";
-        return IO_ERR;
+    memset(buffer.data(), 0, BSZ);
+    if (extra_bytes != fread(buffer.data(), 1, extra_bytes, in_idx)) {
+        return "Error reading block from input file";
     }
+    ws.read += extra_bytes;
 
-    if (!check(buffer)) {
-        if (extra_bytes != fwrite(buffer, 1, extra_bytes, out_idx)) {
-            cerr << "Error writing to output file\n";
-            return IO_ERR;
+    bool last = !check(buffer.data());
+    if (out_idx && last) {
+        if (extra_bytes != fwrite(buffer.data(), 1, extra_bytes, out_idx)) {
+            return "Error writing to output file";
         }
-        BIT_SET(line, bit_pos);
+        ws.written += extra_bytes;
     }
-    line += 4; // Points to the header end
-    fclose(in_idx);
-
-#undef BIT_SET
-
-    if (!opt.quiet)
-        cout << "Index packed from " << in_size << " to " << FTELL(out_idx) << endl;
-
-    // line should point to the end of header
-    assert(header.size() == line);
+    bitmap.add_last(last);
+    return string();
+}
 
+// Convert the header to the canned format, big endian, with the metadata line
+static void seal_header(vector<uint32_t> &header, uint64_t in_size) {
     // swap all header values to big endian
     for (auto &v : header)
         v = htobe32(v);
@@ -360,55 +492,248 @@ int can(const options &opt) {
 
     // The initial file size, big endian, uses header[2] and header[3]
     *reinterpret_cast<uint64_t *>(&header[2]) = htobe64(in_size);
+}
+
+// Build the summary of the bitmap, from the host order header, ready to be written
+static void build_summary(const vector<uint32_t> &header, vector<uint32_t> &summary) {
+    size_t lines = header.size() / 4 - 1;
+    size_t groups = (lines + GROUP_LINES - 1) / GROUP_LINES;
+    summary.assign(groups + 1 + 4, 0);
+
+    uint32_t count = 0;
+    for (size_t g = 0; g < groups; g++) {
+        summary[g] = htobe32(count);
+        for (size_t l = g * GROUP_LINES; l < min(lines, (g + 1) * GROUP_LINES); l++)
+            for (int i = 1; i < 4; i++)
+                count += canned::popcount(header[4 + 4 * l + i]);
+    }
+    summary[groups] = htobe32(count);
+
+    // The footer
+    uint32_t *footer = &summary[groups + 1];
+    footer[0] = *reinterpret_cast<const uint32_t *>(SUM_SIG);
+    footer[1] = htobe32(static_cast<uint32_t>(GROUP_LINES));
+    *reinterpret_cast<uint64_t *>(&footer[2]) = htobe64(groups);
+}
+
+static string write_summary(const vector<uint32_t> &summary, FILE *out_idx, workspace &ws) {
+    if (summary.size() != fwrite(summary.data(), sizeof(uint32_t), summary.size(), out_idx)) {
+        return "Error writing the summary";
+    }
+    ws.written += summary.size() * sizeof(uint32_t);
+    return string();
+}
+
+// Copy the input blocks marked in the sealed header to out, in order
+// Runs of consecutive blocks are copied with a single read and write
+// Returns an error message, or empty on success
+static string copy_blocks(FILE *in_idx, uint64_t in_size, const vector<uint32_t> &header, FILE *out_idx,
+    workspace &ws)
+{
+    auto &buffer = ws.buffer;
+    uint64_t in_block_count = (BSZ - 1 + in_size) / BSZ;
+    uint64_t block = 0;
+    while (block < in_block_count) {
+        uint64_t line = 4 + 4 * (block / 96);
+        int bit = block % 96;
+        if (!(be32toh(header[line + 1 + bit / 32]) & (static_cast<uint32_t>(1) << (bit % 32)))) {
+            block++;
+            continue;
+        }
+        uint64_t run = 0;
+        for (; run < BATCH && block + run < in_block_count; run++) {
+            line = 4 + 4 * ((block + run) / 96);
+            bit = (block + run) % 96;
+            if (!(be32toh(header[line + 1 + bit / 32]) & (static_cast<uint32_t>(1) << (bit % 32))))
+                break;
+        }
+        // The last block may be partial
+        size_t len = static_cast<size_t>(min(run * BSZ, in_size - block * BSZ));
+        FSEEK(in_idx, block * BSZ, SEEK_SET);
+        if (len != fread(buffer.data(), 1, len, in_idx)) {
+            return "Error reading block from input file";
+        }
+        if (len != fwrite(buffer.data(), 1, len, out_idx)) {
+            return "Error writing to output file";
+        }
+        ws.read += len;
+        ws.written += len;
+        block += run;
+    }
+    return string();
+}
+
+// Check the file names for canning, returns an error message or empty
+static string can_names(const string &in_idx_name, const string &out_idx_name, const options &opt) {
+    if (!opt.generic) {
+        if (!substr_equal(in_idx_name, ".idx", -4))
+            return "Input file should have an .idx extension";
+
+        if (!substr_equal(out_idx_name, ".ix", -3) && out_idx_name != "-")
+            return "Output file should have an .ix extension, or be -";
+    }
+
+    if (in_idx_name == "-")
+        return "Input has to be a file when canning";
+    return string();
+}
+
+// Returns an error message, or empty on success
+static string can(const string &in_idx_name, const string &out_idx_name, const options &opt, workspace &ws) {
+    FILE *in_idx = fopen(in_idx_name.c_str(), "rb");
+    FILE *out_idx = stdout;
+    if (out_idx_name != "-")
+        out_idx = fopen(out_idx_name.c_str(), "wb");
+    file_guard in_guard(in_idx), out_guard(out_idx);
+
+    if (!in_idx || !out_idx) {
+        return "Error opening " + (in_idx ? out_idx_name : in_idx_name);
+    }
+
+    // If the output can't seek, the bitmap is built first, then the output is
+    // written in order. Messages go to stderr, stdout might be the output
+    bool streaming = (out_idx == stdout) || FSEEK(out_idx, 0, SEEK_SET);
+    ostream &msg = streaming ? cerr : cout;
+    if (streaming) {
+#if defined(_WIN32)
+        _setmode(_fileno(out_idx), _O_BINARY);
+#endif
+        setvbuf(out_idx, nullptr, _IOFBF, BATCH * BSZ / 4);
+    }
+
+    FSEEK(in_idx, 0, SEEK_END);
+    uint64_t in_size = static_cast<uint64_t>(FTELL(in_idx));
+    FSEEK(in_idx, 0, SEEK_SET);
+
+    // Input has to be an index, which is always a multiple of 16 bytes
+    if ( (!opt.generic) && in_size % 16) {
+        return "Input file is not an index file, size is not a multiple of 16";
+    }
+
+    uint64_t header_size = hsize(in_size);
+    if (!opt.quiet)
+        msg << "Header will be " << header_size << " bytes" << endl;
+
+    // Get space for the header, reusing the previous allocation
+    auto &header = ws.header;
+    header.assign(header_size / sizeof(uint32_t), 0);
+
+    // Skip the reserved line
+    bitmap_builder bitmap(header);
+
+    if (streaming) {
+        // Build the bitmap, then write the header and copy the blocks
+        string err = scan_index(in_idx, in_size, bitmap, nullptr, ws);
+        if (!err.empty())
+            return err;
+        assert(header.size() == bitmap.end());
+        if (opt.summary)
+            build_summary(header, ws.summary);
+        seal_header(header, in_size);
+        if (header.size() != fwrite(header.data(), sizeof(uint32_t), header.size(), out_idx)) {
+            return "Error writing output header";
+        }
+        uint64_t written = ws.written;
+        ws.written += header.size() * sizeof(uint32_t);
+        err = copy_blocks(in_idx, in_size, header, out_idx, ws);
+        in_guard.close();
+        if (err.empty() && opt.summary)
+            err = write_summary(ws.summary, out_idx, ws);
+        if (!err.empty())
+            return err;
+        if (!opt.quiet)
+            msg << "Index packed from " << in_size << " to " << ws.written - written << endl;
+        if (fflush(out_idx) || out_guard.close()) {
+            return "Error writing to output file";
+        }
+        return string();
+    }
+
+    // Reserve space for the header on disk, it will be written at the end
+    fwrite(header.data(), sizeof(uint32_t), header.size(), out_idx);
+
+    string err = scan_index(in_idx, in_size, bitmap, out_idx, ws);
+    if (!err.empty())
+        return err;
+    in_guard.close();
+
+    // line should point to the end of header
+    assert(header.size() == bitmap.end());
+
+    // The summary goes after the last block
+    if (opt.summary) {
+        build_summary(header, ws.summary);
+        err = write_summary(ws.summary, out_idx, ws);
+        if (!err.empty())
+            return err;
+    }
+
+    if (!opt.quiet)
+        msg << "Index packed from " << in_size << " to " << FTELL(out_idx) << endl;
+
+    seal_header(header, in_size);
 
     // Done, write the header at the begining of the file
     FSEEK(out_idx, 0, SEEK_SET);
     if (header.size() != fwrite(header.data(), sizeof(uint32_t), header.size(), out_idx)) {
-        cerr << "Error writing output header\n";
-        return IO_ERR;
+        return "Error writing output header";
+    }
+    ws.written += header.size() * sizeof(uint32_t);
+    if (out_guard.close()) {
+        return "Error writing to output file";
     }
-    fclose(out_idx);
 
-    return NO_ERR;
+    return string();
 }
 
 
-int uncan(const options &opt) {
-    if (opt.file_names.size() != 2)
-        return Usage("Need an input and an output name, use - to use stdin or stdout");
-
-    string in_idx_name(opt.file_names[0]);
-    string out_idx_name(opt.file_names[1]);
-
+// Check the file names for uncanning, returns an error message or empty
+static string uncan_names(const string &in_idx_name, const string &out_idx_name, const options &opt) {
     if (!opt.generic) {
-        if (!substr_equal(in_idx_name, ".ix", -3) && (in_idx_name != "-"))
-            return Usage("Input file should have an .ix extension, or be -");
+        if (!substr_equal(in_idx_name, ".ix", -3) && (in_idx_name != "-") && !canned::is_url(in_idx_name))
+            return "Input file should have an .ix extension, or be -";
 
         if (!substr_equal(out_idx_name, ".idx", -4))
-            return Usage("Output file should have an .idx extension");
+            return "Output file should have an .idx extension";
     }
+    return string();
+}
 
-    FILE *in_idx = stdin;
-    if (in_idx_name != "-")
-        in_idx = fopen(in_idx_name.c_str(), "rb");
+// Returns an error message, or empty on success
+static string uncan(const string &in_idx_name, const string &out_idx_name, const options &opt, workspace &ws) {
 
-    FILE *out_idx = fopen(out_idx_name.c_str(), "wb");
-    SETSPARSE(out_idx);
+    // Input can be a file, stdin or a URL
+    if (in_idx_name == "-") {
+#if defined(_WIN32)
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        setvbuf(stdin, nullptr, _IOFBF, BATCH * BSZ / 4);
+    }
 
-    if (!in_idx || !out_idx) {
-        cerr << "Can't open " << (in_idx ? out_idx_name : in_idx_name) << endl;
-        return IO_ERR;
+    string error;
+    auto in_idx = canned::open_source(in_idx_name, error);
+    if (!in_idx) {
+        return error;
+    }
+
+    FILE *out_idx = fopen(out_idx_name.c_str(), "wb");
+    if (!out_idx) {
+        return "Can't open " + out_idx_name;
     }
+    file_guard out_guard(out_idx);
+    SETSPARSE(out_idx);
 
+    // Read position in the input
+    uint64_t in_pos = 0;
     vector<uint32_t> header(4);
-    if (4 != fread(header.data(), sizeof(uint32_t), 4, in_idx)) {
-        cerr << "Error reading from input header\n";
-        return IO_ERR;
+    if (!in_idx->read_all(in_pos, 4 * sizeof(uint32_t), header.data())) {
+        return "Error reading from input header";
     }
+    in_pos += 4 * sizeof(uint32_t);
 
     // Verify and unpack the header line
     if (header[0] != *reinterpret_cast<const uint32_t *>(SIG))
-        return Usage("Input is not a canned file, wrong magic");
+        return "Input is not a canned file, wrong magic";
     // in 16 byte units, convert it to 4 byte units
     uint32_t header_size = 4 * be32toh(header[1]);
 
@@ -416,7 +741,7 @@ int uncan(const options &opt) {
 
     // Verify that the sizes make sense
     if (static_cast<uint64_t>(header_size) * 4 != hsize(out_size))
-        return Usage("Input header is corrupt");
+        return "Input header is corrupt";
 
     if (!opt.quiet)
         cout << "Output size will be " << out_size << endl;
@@ -424,12 +749,13 @@ int uncan(const options &opt) {
     header_size -= 4;
 
     // The bitmap part of the header
-    vector<uint32_t> bitmap(header_size);
+    auto &bitmap = ws.header;
+    bitmap.resize(header_size);
 
-    if (header_size != fread(bitmap.data(), sizeof(uint32_t), header_size, in_idx)) {
-        cerr << "Error reading input bitmap\n";
-        return IO_ERR;
+    if (!in_idx->read_all(in_pos, header_size * sizeof(uint32_t), bitmap.data())) {
+        return "Error reading input bitmap";
     }
+    in_pos += header_size * sizeof(uint32_t);
 
     // Swap bitmap to host
     for (auto &it : bitmap)
@@ -444,6 +770,11 @@ int uncan(const options &opt) {
 
     // How many output blocks are empty
     uint64_t empties = 0;
+    // Blocks with data not yet transferred, they are contiguous in the input
+    uint64_t pending = 0;
+    auto &buffer = ws.buffer;
+
+    string err;
 
     // Loop over input lines
     while (num_blocks) {
@@ -453,10 +784,14 @@ int uncan(const options &opt) {
 
         // Check that the running count for the line agrees
         if (count && count != bitmap[line])
-            return Usage("Input bitmap is corrupt\n");
+            return "Input bitmap is corrupt";
 
         for (int bit= 0; bit < bits; bit++, num_blocks--) {
             if (!is_on(&bitmap[line], bit)) {
+                // Transfer the pending run before skipping over empty blocks
+                if (pending && !(err = transfer(*in_idx, in_pos, out_idx, pending * BSZ, buffer)).empty())
+                    return err;
+                pending = 0;
                 empties++;
                 continue;
             }
@@ -465,16 +800,16 @@ int uncan(const options &opt) {
                 FSEEK(out_idx, empties * BSZ, SEEK_CUR);
             empties = 0;
 
-            // Transfer the block from in to out
-            if (!transfer(in_idx, out_idx))
-                return IO_ERR;
-
+            pending++;
             count++; // One more transferred block
         }
 
         line += 4;
     }
 
+    if (pending && !(err = transfer(*in_idx, in_pos, out_idx, pending * BSZ, buffer)).empty())
+        return err;
+
     if (empties)
         FSEEK(out_idx, empties * BSZ, SEEK_CUR);
 
@@ -488,20 +823,108 @@ int uncan(const options &opt) {
 
         // Check the running count if the partial block is bit 0
         if ((bit == 0) && (count != bitmap[line]))
-            return Usage("Input bitmap is corrupt\n");
+            return "Input bitmap is corrupt";
 
         // Last bytes could be empty
-        if (is_on(&bitmap[line], bit) && !transfer(in_idx, out_idx, extra_bytes))
-                return IO_ERR;
+        if (is_on(&bitmap[line], bit) && !(err = transfer(*in_idx, in_pos, out_idx, extra_bytes, buffer)).empty())
+            return err;
     }
 
     // Need to end the file at the right size
     FSEEK(out_idx, out_size, SEEK_SET);
     MARK_END(out_idx);
-    fclose(out_idx);
-    fclose(in_idx);
+    ws.read += in_pos;
+    ws.written += in_pos - (header_size + 4) * sizeof(uint32_t);
+    if (out_guard.close()) {
+        return "Error writing to output file";
+    }
 
-    return NO_ERR;
+    return string();
+}
+
+// Read the input and output name pairs from a list file, appending them to names
+// Empty lines and lines starting with # are ignored
+static bool read_list(const string &fname, vector<string> &names) {
+    ifstream list(fname);
+    if (!list)
+        return false;
+    string line;
+    while (getline(list, line)) {
+        auto start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#')
+            continue;
+        // Two names, separated by white space
+        string in_name, out_name;
+        auto sep = line.find_first_of(" \t", start);
+        if (sep != string::npos) {
+            in_name = line.substr(start, sep - start);
+            auto ostart = line.find_first_not_of(" \t", sep);
+            if (ostart != string::npos)
+                out_name = line.substr(ostart, line.find_last_not_of(" \t\r") + 1 - ostart);
+        }
+        if (out_name.empty()) {
+            cerr << "Need an input and an output name, " << line << endl;
+            return false;
+        }
+        names.push_back(in_name);
+        names.push_back(out_name);
+    }
+    return true;
+}
+
+// Process many pairs of file names on a pool of threads
+// Each worker takes the next pair and reuses its own buffers
+static int batch(const options &opt) {
+    size_t pairs = opt.file_names.size() / 2;
+    size_t threads = opt.threads ? opt.threads : max(1u, thread::hardware_concurrency());
+    threads = min(threads, pairs);
+
+    // Per file messages are not useful here
+    options fopt(opt);
+    fopt.quiet = true;
+
+    atomic<size_t> next(0);
+    mutex lock;
+    int result = NO_ERR;
+    size_t failed = 0;
+    uint64_t bytes_read = 0, bytes_written = 0;
+
+    auto worker = [&]() {
+        workspace ws;
+        for (size_t i = next++; i < pairs; i = next++) {
+            const string &in_name = opt.file_names[2 * i];
+            const string &out_name = opt.file_names[2 * i + 1];
+            string err = opt.un ? uncan(in_name, out_name, fopt, ws) : can(in_name, out_name, fopt, ws);
+            if (!err.empty()) {
+                lock_guard<mutex> guard(lock);
+                cerr << in_name << ": " << err << endl;
+                failed++;
+                result = IO_ERR;
+            }
+        }
+        lock_guard<mutex> guard(lock);
+        bytes_read += ws.read;
+        bytes_written += ws.written;
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> pool;
+    for (size_t i = 1; i < threads; i++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (!opt.quiet) {
+        cout << (opt.un ? "Uncanned " : "Canned ") << pairs - failed << " of " << pairs
+            << " files on " << threads << " threads, in " << seconds << " seconds" << endl;
+        cout << "Read " << bytes_read << " bytes, wrote " << bytes_written << " bytes";
+        if (seconds > 0)
+            cout << ", " << (bytes_read + bytes_written) / seconds / 1024 / 1024 << " MB/s";
+        cout << endl;
+    }
+    return result;
 }
 
 int main(int argc, char **argv)
@@ -510,7 +933,34 @@ int main(int argc, char **argv)
     if (!opt.error.empty())
         return Usage(opt.error);
 
-    if (opt.un)
-        return uncan(opt);
-    return can(opt);
+    if (!opt.manifest.empty() && !read_list(opt.manifest, opt.file_names)) {
+        cerr << "Can't read list " << opt.manifest << endl;
+        return IO_ERR;
+    }
+
+    if (opt.file_names.size() < 2 || opt.file_names.size() % 2)
+        return Usage("Need pairs of input and output names");
+
+    // Check all names before starting
+    for (size_t i = 0; i < opt.file_names.size(); i += 2) {
+        auto &in_name = opt.file_names[i];
+        auto &out_name = opt.file_names[i + 1];
+        string error = opt.un ? uncan_names(in_name, out_name, opt) : can_names(in_name, out_name, opt);
+        if (error.empty() && opt.file_names.size() > 2 && (in_name == "-" || out_name == "-"))
+            error = "Can't use - with more than one pair of names";
+        if (!error.empty())
+            return Usage(error);
+    }
+
+    if (opt.file_names.size() > 2)
+        return batch(opt);
+
+    workspace ws;
+    string err = opt.un ? uncan(opt.file_names[0], opt.file_names[1], opt, ws)
+        : can(opt.file_names[0], opt.file_names[1], opt, ws);
+    if (!err.empty()) {
+        cerr << err << endl;
+        return IO_ERR;
+    }
+    return NO_ERR;
 }
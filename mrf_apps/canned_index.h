@@ -0,0 +1,801 @@
+/*
+ * file: canned_index.h
+ *
+ * Purpose:
+ *
+ * Random access to the MRF index entries stored in a canned index file,
+ * without uncanning it. See can.cpp for the canned format description.
+ *
+ * The bitmap is read once when the file is opened and stays resident. Locating
+ * the canned block for a given index block is done in memory, using the running
+ * count of the bitmap line and a popcount of the bits before the block bit.
+ * Only the 512 byte data blocks holding the requested entries are read.
+ *
+ * The canned file is read through a byte_source, which can be a local file,
+ * a forward only stream or, when built with HAVE_CURL, an http(s) or s3 URL.
+ * Remote sources are wrapped in a small LRU block cache, so the header and
+ * bitmap are usually fetched with a single request, and nearby blocks are
+ * read with coalesced range requests.
+ *
+ * When the canned file has a summary (can -s) and it is opened with preload set to false,
+ * the bitmap is not read when opening. The summary holds the running count at the start of
+ * every group of 4096 bitmap lines, so it tells which groups are empty, the other groups are
+ * read when first needed, 64KB at a time. The summary ends with a footer at the end of the file,
+ * so opening takes two small reads, one from each end. Locating a tile then takes a read of its
+ * group for the first tile in the group and one read of the entry.
+ *
+ * Usage:
+ *
+ *   CannedIndex idx;
+ *   std::string error = idx.open("file.ix");
+ *   uint64_t offset, size;
+ *   if (error.empty() && idx.lookup(tile, offset, size)) { ... }
+ *
+ * lookup() can be called from multiple threads, except for stream sources
+ */
+
+#if !defined(CANNED_INDEX_H)
+#define CANNED_INDEX_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+
+#if defined(_WIN32)
+#include <intrin.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <endian.h>
+#endif
+
+#if defined(HAVE_CURL)
+#include <curl/curl.h>
+#endif
+
+namespace canned {
+
+// Canned block size, matches can.cpp
+const int BSZ = 512;
+// Index blocks per bitmap line
+const int LINE_BLOCKS = 96;
+// Bytes in one MRF index entry
+const int ENTRY_SIZE = 16;
+// 4 byte signature string
+const char SIG[] = "IDX";
+// Summary signature, and bitmap lines per summary value
+const char SUM_SIG[] = "IXS";
+const int GROUP_LINES = 4096;
+
+// Size of the canned header for a given index size, matches can.cpp
+inline uint64_t hsize(uint64_t in_size) {
+    return 16 + 16 * ((LINE_BLOCKS * BSZ - 1 + in_size) / (LINE_BLOCKS * BSZ));
+}
+
+inline int popcount(uint32_t v) {
+#if defined(_MSC_VER)
+    return static_cast<int>(__popcnt(v));
+#else
+    return __builtin_popcount(v);
+#endif
+}
+
+inline uint32_t be32(uint32_t v) {
+#if defined(_WIN32)
+    return _byteswap_ulong(v);
+#else
+    return be32toh(v);
+#endif
+}
+
+inline uint64_t be64(uint64_t v) {
+#if defined(_WIN32)
+    return _byteswap_uint64(v);
+#else
+    return be64toh(v);
+#endif
+}
+
+// An MRF index entry, host order
+struct tinfo {
+    uint64_t offset;
+    uint64_t size;
+};
+
+// Random access byte source, read by range
+class byte_source {
+public:
+    virtual ~byte_source() {}
+
+    // Read up to len bytes at offset, returns the number of bytes read or -1 on error
+    // Fewer than len bytes are returned only at the end of the source
+    virtual int64_t read(uint64_t offset, uint64_t len, void *buffer) = 0;
+
+    // Distance between two ranges which is cheaper to read through than to skip
+    virtual uint64_t coalesce_gap() const { return 0; }
+
+    // Read the last len bytes with a single read, sets offset to where they start
+    // Returns false on error, if the source is shorter or if it can't read from the end
+    virtual bool read_tail(uint64_t, void *, uint64_t &) { return false; }
+
+    bool read_all(uint64_t offset, uint64_t len, void *buffer) {
+        return static_cast<int64_t>(len) == read(offset, len, buffer);
+    }
+};
+
+// Local file, safe to use from multiple threads
+class file_source : public byte_source {
+public:
+    file_source() :
+#if defined(_WIN32)
+        file(nullptr) {}
+    ~file_source() { if (file) fclose(file); }
+    bool open(const std::string &fname) {
+        file = fopen(fname.c_str(), "rb");
+        return nullptr != file;
+    }
+#else
+        fd(-1) {}
+    ~file_source() { if (fd >= 0) ::close(fd); }
+    bool open(const std::string &fname) {
+        fd = ::open(fname.c_str(), O_RDONLY);
+        return fd >= 0;
+    }
+#endif
+
+    int64_t read(uint64_t offset, uint64_t len, void *buffer) override {
+#if defined(_WIN32)
+        std::lock_guard<std::mutex> lock(mtx);
+        if (_fseeki64(file, offset, SEEK_SET))
+            return -1;
+        size_t got = fread(buffer, 1, static_cast<size_t>(len), file);
+        return ferror(file) ? -1 : static_cast<int64_t>(got);
+#else
+        auto p = reinterpret_cast<char *>(buffer);
+        uint64_t done = 0;
+        while (done < len) {
+            ssize_t got = pread(fd, p + done, static_cast<size_t>(len - done),
+                static_cast<off_t>(offset + done));
+            if (got < 0)
+                return -1;
+            if (got == 0)
+                break; // End of file
+            done += got;
+        }
+        return static_cast<int64_t>(done);
+#endif
+    }
+
+    bool read_tail(uint64_t len, void *buffer, uint64_t &offset) override {
+        uint64_t size;
+#if defined(_WIN32)
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (_fseeki64(file, 0, SEEK_END))
+                return false;
+            size = static_cast<uint64_t>(_ftelli64(file));
+        }
+#else
+        struct stat statb;
+        if (fstat(fd, &statb))
+            return false;
+        size = static_cast<uint64_t>(statb.st_size);
+#endif
+        if (size < len)
+            return false;
+        offset = size - len;
+        return read_all(offset, len, buffer);
+    }
+
+private:
+#if defined(_WIN32)
+    FILE *file;
+    std::mutex mtx;
+#else
+    int fd;
+#endif
+};
+
+// Sequential stream, such as stdin. Reads have to be in increasing offset order,
+// gaps are skipped. Not thread safe
+class stream_source : public byte_source {
+public:
+    stream_source(FILE *f) : file(f), pos(0) {}
+
+    int64_t read(uint64_t offset, uint64_t len, void *buffer) override {
+        if (offset < pos)
+            return -1; // Can't go back
+        char skip[BSZ];
+        while (pos < offset) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(offset - pos, sizeof(skip)));
+            size_t got = fread(skip, 1, n, file);
+            pos += got;
+            if (got != n)
+                return ferror(file) ? -1 : 0;
+        }
+        size_t got = fread(buffer, 1, static_cast<size_t>(len), file);
+        pos += got;
+        return ferror(file) ? -1 : static_cast<int64_t>(got);
+    }
+
+private:
+    FILE *file;
+    uint64_t pos;
+};
+
+#if defined(HAVE_CURL)
+// Range requests over http(s), one connection per concurrent reader, reused
+class http_source : public byte_source {
+public:
+    // s3://bucket/key is read from the public bucket endpoint
+    http_source(const std::string &name) : url(name) {
+        static std::once_flag init;
+        std::call_once(init, [] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+        if (0 == url.compare(0, 5, "s3://")) {
+            auto slash = url.find('/', 5);
+            auto bucket = url.substr(5, slash == std::string::npos ? std::string::npos : slash - 5);
+            url = "https://" + bucket + ".s3.amazonaws.com"
+                + (slash == std::string::npos ? std::string("/") : url.substr(slash));
+        }
+    }
+
+    ~http_source() {
+        for (auto h : handles)
+            curl_easy_cleanup(h);
+    }
+
+    int64_t read(uint64_t offset, uint64_t len, void *buffer) override {
+        if (!len)
+            return 0;
+        CURL *h = acquire();
+        if (!h)
+            return -1;
+        char range[48];
+        snprintf(range, sizeof(range), "%llu-%llu", static_cast<unsigned long long>(offset),
+            static_cast<unsigned long long>(offset + len - 1));
+        sink s = { reinterpret_cast<char *>(buffer), len, 0 };
+        curl_easy_setopt(h, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(h, CURLOPT_RANGE, range);
+        curl_easy_setopt(h, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, write_cb);
+        curl_easy_setopt(h, CURLOPT_WRITEDATA, &s);
+        CURLcode rc = curl_easy_perform(h);
+        long code = 0;
+        curl_easy_getinfo(h, CURLINFO_RESPONSE_CODE, &code);
+        release(h);
+        if (416 == code)
+            return 0; // Range starts past the end
+        // A 200 means the range was ignored, only usable from the start
+        if (CURLE_OK != rc || (206 != code && !(200 == code && 0 == offset)))
+            return -1;
+        return static_cast<int64_t>(s.used);
+    }
+
+    // A new request costs more than reading a few more KB
+    uint64_t coalesce_gap() const override { return 64 * 1024; }
+
+    // Suffix range request, the start comes from the Content-Range header
+    bool read_tail(uint64_t len, void *buffer, uint64_t &offset) override {
+        if (!len)
+            return false;
+        CURL *h = acquire();
+        if (!h)
+            return false;
+        char range[48];
+        snprintf(range, sizeof(range), "-%llu", static_cast<unsigned long long>(len));
+        sink s = { reinterpret_cast<char *>(buffer), len, 0 };
+        uint64_t start = UINT64_MAX;
+        curl_easy_setopt(h, CURLOPT_URL, url.c_str());
+        curl_easy_setopt(h, CURLOPT_RANGE, range);
+        curl_easy_setopt(h, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(h, CURLOPT_WRITEFUNCTION, write_cb);
+        curl_easy_setopt(h, CURLOPT_WRITEDATA, &s);
+        curl_easy_setopt(h, CURLOPT_HEADERFUNCTION, header_cb);
+        curl_easy_setopt(h, CURLOPT_HEADERDATA, &start);
+        CURLcode rc = curl_easy_perform(h);
+        long code = 0;
+        curl_easy_getinfo(h, CURLINFO_RESPONSE_CODE, &code);
+        // The handle is reused for plain range reads
+        curl_easy_setopt(h, CURLOPT_HEADERFUNCTION, nullptr);
+        curl_easy_setopt(h, CURLOPT_HEADERDATA, nullptr);
+        release(h);
+        // A shorter source returns fewer bytes, starting at 0
+        if (CURLE_OK != rc || 206 != code || UINT64_MAX == start || s.used != len)
+            return false;
+        offset = start;
+        return true;
+    }
+
+private:
+    struct sink {
+        char *buffer;
+        uint64_t len;
+        uint64_t used;
+    };
+
+    // Picks the first byte position from "Content-Range: bytes start-end/size"
+    static size_t header_cb(char *data, size_t size, size_t nmemb, void *user) {
+        size_t n = size * nmemb;
+        static const char name[] = "content-range:";
+        std::string line(data, n);
+        for (size_t i = 0; i < line.size() && i < sizeof(name) - 1; i++)
+            line[i] = static_cast<char>(tolower(static_cast<unsigned char>(line[i])));
+        if (0 == line.compare(0, sizeof(name) - 1, name)) {
+            auto pos = line.find("bytes");
+            unsigned long long start;
+            if (pos != std::string::npos && 1 == sscanf(line.c_str() + pos + 5, " %llu-", &start))
+                *reinterpret_cast<uint64_t *>(user) = start;
+        }
+        return n;
+    }
+
+    static size_t write_cb(char *data, size_t size, size_t nmemb, void *user) {
+        auto s = reinterpret_cast<sink *>(user);
+        size_t n = size * nmemb;
+        size_t keep = static_cast<size_t>(std::min<uint64_t>(n, s->len - s->used));
+        memcpy(s->buffer + s->used, data, keep);
+        s->used += keep;
+        return n; // Ignore the extra, if any
+    }
+
+    CURL *acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!handles.empty()) {
+                CURL *h = handles.back();
+                handles.pop_back();
+                return h;
+            }
+        }
+        return curl_easy_init();
+    }
+
+    void release(CURL *h) {
+        std::lock_guard<std::mutex> lock(mtx);
+        handles.push_back(h);
+    }
+
+    std::string url;
+    std::mutex mtx;
+    std::vector<CURL *> handles; // Idle handles
+};
+#endif
+
+// LRU cache of fixed size blocks in front of another source, for remote sources
+// Missing blocks that are adjacent are fetched with a single read
+class block_cache : public byte_source {
+public:
+    block_cache(std::unique_ptr<byte_source> source, uint64_t block_size = 64 * 1024,
+        size_t max_blocks = 64) :
+        src(std::move(source)), bsize(block_size), max_blocks(max_blocks) {}
+
+    int64_t read(uint64_t offset, uint64_t len, void *buffer) override {
+        if (!len)
+            return 0;
+        uint64_t first = offset / bsize;
+        uint64_t last = (offset + len - 1) / bsize;
+        std::vector<block_ptr> blocks(static_cast<size_t>(last - first + 1));
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (uint64_t b = first; b <= last; b++) {
+                auto it = cache.find(b);
+                if (it == cache.end())
+                    continue;
+                lru.splice(lru.begin(), lru, it->second.first);
+                blocks[static_cast<size_t>(b - first)] = it->second.second;
+            }
+        }
+
+        // Fetch the runs of missing blocks, outside of the lock
+        for (size_t i = 0; i < blocks.size();) {
+            if (blocks[i]) {
+                i++;
+                continue;
+            }
+            size_t j = i;
+            while (j < blocks.size() && !blocks[j])
+                j++;
+            std::vector<uint8_t> data(static_cast<size_t>((j - i) * bsize));
+            int64_t got = src->read((first + i) * bsize, data.size(), data.data());
+            if (got < 0)
+                return -1;
+            for (size_t k = i; k < j; k++) {
+                uint64_t start = (k - i) * bsize;
+                uint64_t end = std::min<uint64_t>(start + bsize, got);
+                auto b = std::make_shared<std::vector<uint8_t>>();
+                if (end > start)
+                    b->assign(data.begin() + start, data.begin() + end);
+                blocks[k] = b;
+                insert(first + k, b);
+            }
+            i = j;
+        }
+
+        // Copy out, stopping at the end of the source
+        auto out = reinterpret_cast<uint8_t *>(buffer);
+        uint64_t done = 0;
+        for (size_t i = 0; i < blocks.size() && done < len; i++) {
+            uint64_t start = (first + i) * bsize;
+            uint64_t from = std::max(offset, start) - start;
+            if (from >= blocks[i]->size())
+                break;
+            uint64_t n = std::min<uint64_t>(blocks[i]->size() - from, len - done);
+            memcpy(out + done, blocks[i]->data() + from, static_cast<size_t>(n));
+            done += n;
+            if (blocks[i]->size() < bsize)
+                break; // Last block
+        }
+        return static_cast<int64_t>(done);
+    }
+
+    uint64_t coalesce_gap() const override { return src->coalesce_gap(); }
+
+    // Not cached, it is only read once
+    bool read_tail(uint64_t len, void *buffer, uint64_t &offset) override {
+        return src->read_tail(len, buffer, offset);
+    }
+
+private:
+    typedef std::shared_ptr<const std::vector<uint8_t>> block_ptr;
+
+    void insert(uint64_t b, const block_ptr &data) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (cache.count(b))
+            return;
+        lru.push_front(b);
+        cache[b] = std::make_pair(lru.begin(), data);
+        if (cache.size() > max_blocks) {
+            cache.erase(lru.back());
+            lru.pop_back();
+        }
+    }
+
+    std::unique_ptr<byte_source> src;
+    uint64_t bsize;
+    size_t max_blocks;
+    std::mutex mtx;
+    std::list<uint64_t> lru; // Most recent first
+    std::unordered_map<uint64_t, std::pair<std::list<uint64_t>::iterator, block_ptr>> cache;
+};
+
+inline bool is_url(const std::string &name) {
+    return 0 == name.compare(0, 7, "http://") || 0 == name.compare(0, 8, "https://")
+        || 0 == name.compare(0, 5, "s3://");
+}
+
+// Source for a name, which can be a file, - for stdin or a URL
+// Returns nullptr and sets the error message on failure
+inline std::unique_ptr<byte_source> open_source(const std::string &name, std::string &error) {
+    if (name == "-")
+        return std::unique_ptr<byte_source>(new stream_source(stdin));
+    if (is_url(name)) {
+#if defined(HAVE_CURL)
+        return std::unique_ptr<byte_source>(
+            new block_cache(std::unique_ptr<byte_source>(new http_source(name))));
+#else
+        error = "Not built with URL support, " + name;
+        return nullptr;
+#endif
+    }
+    auto f = new file_source;
+    if (!f->open(name)) {
+        delete f;
+        error = "Can't open " + name;
+        return nullptr;
+    }
+    return std::unique_ptr<byte_source>(f);
+}
+
+} // namespace canned
+
+class CannedIndex {
+public:
+    CannedIndex() : in_size(0), header_size(0), lazy(false), load_error(false) {}
+
+    // Open a canned index file or URL and load the bitmap
+    // Without preload, if the file has a summary, the bitmap is read as needed
+    // Returns an error message, or empty on success
+    std::string open(const std::string &name, bool preload = true) {
+        std::string error;
+        auto source = canned::open_source(name, error);
+        if (!source)
+            return error;
+        return open(std::move(source), preload);
+    }
+
+    // Same, from a byte source
+    std::string open(std::unique_ptr<canned::byte_source> source, bool preload = true) {
+        close();
+        src = std::move(source);
+        uint32_t line[4];
+        if (!read_at(0, sizeof(line), line))
+            return "Error reading canned header";
+        if (memcmp(line, canned::SIG, 4))
+            return "Not a canned index, wrong magic";
+        header_size = static_cast<uint64_t>(canned::be32(line[1])) * 16;
+        uint64_t sz;
+        memcpy(&sz, &line[2], sizeof(sz));
+        in_size = canned::be64(sz);
+        if (header_size != canned::hsize(in_size))
+            return "Canned header is corrupt";
+        if (!preload && load_summary())
+            return std::string();
+        summary.clear();
+
+        // The bitmap lines, after the header line
+        bitmap.resize((header_size - 16) / sizeof(uint32_t));
+        if (!read_at(16, header_size - 16, bitmap.data()))
+            return "Error reading canned bitmap";
+        for (auto &v : bitmap)
+            v = canned::be32(v);
+        return std::string();
+    }
+
+    void close() {
+        src.reset();
+        bitmap.clear();
+        summary.clear();
+        groups.clear();
+        in_size = header_size = 0;
+        lazy = false;
+        load_error = false;
+    }
+
+    // The bitmap is read as needed, using the summary
+    bool has_summary() const { return lazy; }
+
+    // Size of the original index file, in bytes
+    uint64_t size() const { return in_size; }
+
+    // Number of index entries, tiles
+    uint64_t tiles() const { return in_size / canned::ENTRY_SIZE; }
+
+    // Is the original index block stored in the canned file
+    bool present(uint64_t block) const {
+        const uint32_t *line = line_at(block / canned::LINE_BLOCKS);
+        int bit = static_cast<int>(block % canned::LINE_BLOCKS);
+        return 0 != (line[1 + bit / 32] & (static_cast<uint32_t>(1) << (bit % 32)));
+    }
+
+    // Location of an index block within the canned file, 0 if the block is empty
+    uint64_t block_offset(uint64_t block) const {
+        if (block * canned::BSZ >= in_size || !present(block))
+            return 0;
+        const uint32_t *line = line_at(block / canned::LINE_BLOCKS);
+        int bit = static_cast<int>(block % canned::LINE_BLOCKS);
+        // The running count is valid for any line that has bits set
+        uint64_t rank = line[0];
+        for (int i = 0; i < bit / 32; i++)
+            rank += canned::popcount(line[1 + i]);
+        if (bit % 32)
+            rank += canned::popcount(line[1 + bit / 32]
+                & ((static_cast<uint32_t>(1) << (bit % 32)) - 1));
+        return header_size + rank * canned::BSZ;
+    }
+
+    // Runs of stored index blocks, as first block and block count, in order
+    // Lines without any stored block are skipped without looking at the bits, and with a
+    // summary the empty groups of lines are skipped without reading them
+    std::vector<std::pair<uint64_t, uint64_t>> block_runs() const {
+        std::vector<std::pair<uint64_t, uint64_t>> runs;
+        uint64_t blocks = (in_size + canned::BSZ - 1) / canned::BSZ;
+        for (uint64_t l = 0; l < lines(); l++) {
+            if (lazy && group_empty(l / canned::GROUP_LINES)) {
+                l += canned::GROUP_LINES - 1 - l % canned::GROUP_LINES;
+                continue;
+            }
+            const uint32_t *line = line_at(l);
+            if (!(line[1] | line[2] | line[3]))
+                continue;
+            uint64_t first = l * canned::LINE_BLOCKS;
+            for (int bit = 0; bit < canned::LINE_BLOCKS && first + bit < blocks; bit++) {
+                if (!(line[1 + bit / 32] & (static_cast<uint32_t>(1) << (bit % 32))))
+                    continue;
+                if (!runs.empty() && runs.back().first + runs.back().second == first + bit)
+                    runs.back().second++;
+                else
+                    runs.emplace_back(first + bit, 1);
+            }
+        }
+        return runs;
+    }
+
+    // Read count consecutive stored index blocks, which are also consecutive in the canned file
+    // The buffer has to hold count blocks, the last block of the index might be partial
+    bool read_blocks(uint64_t block, uint64_t count, void *buffer) const {
+        uint64_t loc = block_offset(block);
+        if (!loc || !count)
+            return false;
+        uint64_t len = std::min((block + count) * canned::BSZ, in_size) - block * canned::BSZ;
+        return read_at(loc, len, buffer);
+    }
+
+    // Index entry for one tile, returns false on read error or if the tile is out of range
+    // An empty entry is returned as zero offset and size
+    bool lookup(uint64_t tile, uint64_t &offset, uint64_t &size) const {
+        offset = size = 0;
+        if (tile >= tiles())
+            return false;
+        uint64_t pos = tile * canned::ENTRY_SIZE;
+        uint64_t loc = block_offset(pos / canned::BSZ);
+        if (!loc)
+            return !load_error;
+        uint64_t entry[2];
+        if (!read_at(loc + pos % canned::BSZ, sizeof(entry), entry))
+            return false;
+        offset = canned::be64(entry[0]);
+        size = canned::be64(entry[1]);
+        return true;
+    }
+
+    // Index entries for many tiles, in the same order as the tiles
+    // Entries that share a block, or are in canned blocks closer than the source
+    // coalesce gap, are read together
+    bool lookup(const std::vector<uint64_t> &tile_list, std::vector<canned::tinfo> &result) const {
+        result.assign(tile_list.size(), canned::tinfo());
+        // Request positions, ordered by tile
+        std::vector<size_t> order;
+        for (size_t i = 0; i < tile_list.size(); i++) {
+            if (tile_list[i] >= tiles())
+                return false;
+            if (block_offset(tile_list[i] * canned::ENTRY_SIZE / canned::BSZ))
+                order.push_back(i);
+        }
+        if (load_error)
+            return false;
+        std::sort(order.begin(), order.end(),
+            [&](size_t a, size_t b) { return tile_list[a] < tile_list[b]; });
+
+        std::vector<uint8_t> buffer;
+        const uint64_t gap = src->coalesce_gap();
+        for (size_t i = 0; i < order.size();) {
+            // Find a run of requests in nearby canned blocks
+            uint64_t first = block_offset(tile_list[order[i]] * canned::ENTRY_SIZE / canned::BSZ);
+            uint64_t last = first;
+            size_t j = i + 1;
+            for (; j < order.size(); j++) {
+                uint64_t loc = block_offset(tile_list[order[j]] * canned::ENTRY_SIZE / canned::BSZ);
+                if (loc > last + canned::BSZ + gap)
+                    break;
+                last = loc;
+            }
+            // The last block could be partial
+            uint64_t len = std::min(last + canned::BSZ, data_end()) - first;
+            buffer.resize(static_cast<size_t>(len));
+            if (!read_at(first, len, buffer.data()))
+                return false;
+            for (; i < j; i++) {
+                uint64_t pos = tile_list[order[i]] * canned::ENTRY_SIZE;
+                uint64_t off = block_offset(pos / canned::BSZ) - first + pos % canned::BSZ;
+                uint64_t entry[2];
+                memcpy(entry, &buffer[static_cast<size_t>(off)], sizeof(entry));
+                result[order[i]].offset = canned::be64(entry[0]);
+                result[order[i]].size = canned::be64(entry[1]);
+            }
+        }
+        return true;
+    }
+
+    // Read error or corrupt bitmap group, when reading the bitmap as needed
+    bool failed() const { return load_error; }
+
+private:
+    uint64_t lines() const { return (header_size - 16) / 16; }
+
+    // The bitmap line, 4 values in host order
+    // Groups of lines are read when first used, if a read fails the line appears empty
+    const uint32_t *line_at(uint64_t l) const {
+        static const uint32_t empty[4] = { 0, 0, 0, 0 };
+        if (!lazy)
+            return &bitmap[4 * l];
+        uint64_t g = l / canned::GROUP_LINES;
+        if (group_empty(g))
+            return empty;
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = groups.find(g);
+        if (it == groups.end()) {
+            uint64_t first = g * canned::GROUP_LINES;
+            std::vector<uint32_t> group(4 * std::min<uint64_t>(canned::GROUP_LINES, lines() - first));
+            // The first line running count has to match, it is marked if it is zero
+            bool ok = read_at(16 + 16 * first, group.size() * sizeof(uint32_t), group.data());
+            uint32_t count = canned::be32(group[0]);
+            if (!ok || (count != summary[g] && !(summary[g] == 0 && marked(count)))) {
+                load_error = true;
+                return empty;
+            }
+            for (auto &v : group)
+                v = canned::be32(v);
+            it = groups.emplace(g, std::move(group)).first;
+        }
+        return &it->second[4 * (l % canned::GROUP_LINES)];
+    }
+
+    // Running count value of the lines before the first stored block, in host order
+    static bool marked(uint32_t count) {
+        return !memcmp(&count, canned::SIG, 4);
+    }
+
+    // None of the lines in the group have bits set
+    // The summary has one more value, the total count
+    bool group_empty(uint64_t g) const {
+        return summary[g] == summary[g + 1];
+    }
+
+    // Read the summary and its footer, at the end of the file, with a single read
+    // Returns false if there is no valid summary
+    bool load_summary() {
+        uint64_t n = lines();
+        if (!n)
+            return false;
+        // The group values, the total count and the footer line
+        uint64_t ngroups = (n + canned::GROUP_LINES - 1) / canned::GROUP_LINES;
+        std::vector<uint32_t> tail(static_cast<size_t>(ngroups + 1 + 4));
+        uint64_t offset;
+        if (!src->read_tail(tail.size() * sizeof(uint32_t), tail.data(), offset))
+            return false;
+        const uint32_t *footer = &tail[tail.size() - 4];
+        uint64_t groups;
+        memcpy(&groups, &footer[2], sizeof(groups));
+        if (memcmp(footer, canned::SUM_SIG, 4) || canned::be32(footer[1]) != canned::GROUP_LINES
+            || canned::be64(groups) != ngroups)
+            return false;
+        summary.assign(tail.begin(), tail.end() - 4);
+        for (auto &v : summary)
+            v = canned::be32(v);
+
+        // The summary follows the last canned block, which might be partial
+        uint64_t end = header_size + static_cast<uint64_t>(summary.back()) * canned::BSZ;
+        if (offset != end && !(summary.back() && (in_size % canned::BSZ)
+            && offset == end - (canned::BSZ - in_size % canned::BSZ)))
+            return false;
+        // Counts start at zero and never decrease
+        if (summary[0] != 0)
+            return false;
+        for (size_t g = 1; g < summary.size(); g++)
+            if (summary[g] < summary[g - 1])
+                return false;
+        lazy = true;
+        return true;
+    }
+
+    // End of the canned data, based on the last bitmap line running count
+    uint64_t data_end() const {
+        uint64_t blocks = (in_size + canned::BSZ - 1) / canned::BSZ;
+        if (!blocks)
+            return header_size;
+        uint64_t last = blocks - 1;
+        uint64_t loc = block_offset(last);
+        if (loc) // Last block is stored, and might be partial
+            return loc + ((in_size % canned::BSZ) ? in_size % canned::BSZ : canned::BSZ);
+        // Beyond any stored block
+        return UINT64_MAX;
+    }
+
+    bool read_at(uint64_t offset, uint64_t len, void *buffer) const {
+        return src->read_all(offset, len, buffer);
+    }
+
+    std::unique_ptr<canned::byte_source> src;
+    uint64_t in_size;     // Original index size
+    uint64_t header_size; // Canned header size, including the first line
+    std::vector<uint32_t> bitmap; // Host order, 4 ints per line
+
+    // When reading the bitmap as needed
+    bool lazy;
+    std::vector<uint32_t> summary; // Host order, one per group of lines, then the total
+    mutable std::mutex mtx;
+    mutable std::unordered_map<uint64_t, std::vector<uint32_t>> groups; // Bitmap groups read so far
+    mutable std::atomic<bool> load_error;
+};
+
+#endif
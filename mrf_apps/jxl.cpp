@@ -1,5 +1,3 @@
-#include <brunsli/encode.h>
-#include <brunsli/decode.h>
 #include <string>
 #include <iostream>
 #include <vector>
@@ -11,103 +9,404 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
-
-// For Linux
-#include <endian.h>
+#include <cstring>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <dirent.h>
+
+// MRF index entries, includes endian.h
+#include "mrf_index.h"
+// Esri bundle header and index
+#include "bundle.h"
+// Tile conversion, includes the brunsli headers
+#include "jxl_tile.h"
 
 using namespace std;
 
-const static int BSZ(128);
-const static int BSZ2(BSZ*BSZ);
 const static int BUFSZ(1024*1024); // 1MB, kinda small
 
 int Usage(const string &s) {
     cerr << s << endl << endl
     << "Synopsis: jxl [OPTIONS] <source-file>\n"
     << "\t-r\tReverse, convert JXL input to JFIF\n"
-    << "\t-b\tBundle (esri v2) input, default is MRF\n"
-    << "\t-s\tSingle image, input is a JFIF or JXL (with -r)\n";
+    << "\t-b\tBundle (esri v2) input, default is MRF. For a directory, converts all the bundles in it\n"
+    << "\t-i\tBundle only, replace the input bundles with the converted ones\n"
+    << "\t-s\tSingle image, input is a JFIF or JXL (with -r)\n"
+    << "\t-j N\tUse N conversion threads, 0 for all cores, default is 1\n"
+    << "\t-m N\tMaximum number of tiles in flight, default is 4 per thread, at least 1 per thread\n"
+    << "\t-o\tMRF only, read tiles in data file order, output data is in the same order\n"
+    << "\t-c N\tMRF only, checkpoint every N seconds, resume from the checkpoint of an earlier run\n";
     return 1;
 }
 
-struct bundle_index {
-    uint64_t offset : 40;
-    uint64_t size : 24;
-    bool operator<(const bundle_index &other) {
-        return offset < other.offset;
-    }
-};
+// Brunsli sink, writes straight to a file
+static size_t file_fun(void *output, const uint8_t *data, size_t size) {
+    return fwrite(data, 1, size, static_cast<FILE *>(output));
+}
 
-// It's really a pair, so we can sort by offset or by rank
-struct ranked_index {
-    ranked_index(bundle_index idx, uint64_t rank) : idx (idx), rank(rank) {}
-    bundle_index idx;
-    uint64_t rank;
-    bool operator<(const ranked_index &other) {
-        return idx < other.idx;
+// Read only memory mapped input file, tiles are used in place
+struct mapped_file {
+    mapped_file() : data(nullptr), size(0) {}
+    ~mapped_file() {
+        if (data)
+            munmap((void *)data, size);
+    }
+    // Returns an error message, or empty on success
+    string open(const string &fname) {
+        struct stat statb;
+        if (stat(fname.c_str(), &statb))
+            return "Can't stat input file";
+        size = statb.st_size;
+        if (!size)
+            return string(); // Nothing to map
+        int fd = ::open(fname.c_str(), O_RDONLY);
+        if (fd < 0)
+            return "Can't open input file";
+        void *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (MAP_FAILED == p) {
+            cerr << "ERROR: " << strerror(errno) << endl;
+            return "Can't mmap input file";
+        }
+        data = reinterpret_cast<const uint8_t *>(p);
+        return string();
+    }
+    bool contains(uint64_t offset, uint64_t len) const {
+        return offset <= size && len <= size - offset;
     }
+    // Access pattern hint for the whole file, MADV_SEQUENTIAL or MADV_RANDOM
+    void advise(int advice) const {
+        if (data)
+            madvise((void *)data, size, advice);
+    }
+    // Start reading a range ahead of use
+    void prefetch(uint64_t offset, uint64_t len) const {
+        static const uint64_t mask = ~static_cast<uint64_t>(sysconf(_SC_PAGESIZE) - 1);
+        uint64_t start = offset & mask;
+        madvise((void *)(data + start), offset + len - start, MADV_WILLNEED);
+    }
+    const uint8_t *data;
+    uint64_t size;
+private:
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
 };
 
-static_assert(sizeof(bundle_index) == sizeof(uint64_t));
+// One tile conversion, owned by a pipeline slot while in flight
+struct tile_job {
+    uint64_t rank;          // Tile number, position in the index
+    uint64_t offset;        // Input tile location, for messages
+    const uint8_t *data;    // Input tile, in the mapped input
+    size_t size;
+    jxl_tile::arena output; // Converted tile
+    bool ok;
+    int state;
+};
 
-static const int HDRSZ = 64;
-static const int IDXSZ = BSZ2 * sizeof(bundle_index);
+// Called in order, returns 1 for a new tile, 0 when done, -1 on error
+typedef function<int (tile_job &)> reader_fn;
+// Called in order with the converted tile, returns false on error
+typedef function<bool (tile_job &)> writer_fn;
 
-static size_t out_fun(vector<uint8_t> *output, const uint8_t *data, size_t size) {
-    copy(data, data+size, back_inserter(*output));
-    return size;
+// Output is reserved to at least maxsz
+static void convert(tile_job &job, bool reverse, size_t maxsz = 0) {
+    job.ok = jxl_tile::convert_tile(jxl_tile::span(job.data, job.size), job.output,
+        reverse ? jxl_tile::TO_JPEG : jxl_tile::TO_JXL, maxsz);
 }
 
-// Big Endian native
-struct tinfo {
-    uint64_t offset;
-    uint64_t size;
-    void toh() {
-        offset = be64toh(offset);
-        size = be64toh(size);
+// Running conversions, which idle threads can join to convert tiles
+// Used when converting many files, so the threads are not idle while the last ones finish
+struct helper_board {
+    struct entry {
+        entry() : helpers(0) {}
+        function<void ()> work; // Converts tiles, returns when there are no more to convert
+        atomic<int> helpers;
+    };
+
+    explicit helper_board(int threads) : threads(threads), busy(threads) {}
+
+    // A conversion starts, its tiles can be converted by helpers
+    void join(entry &e) {
+        lock_guard<mutex> lock(mtx);
+        active.push_back(&e);
+        cv.notify_all();
     }
-    void ton() {
-        offset = htobe64(offset);
-        size = htobe64(size);
+
+    // A conversion is done, waits for the helpers to return
+    void leave(entry &e) {
+        unique_lock<mutex> lock(mtx);
+        active.remove(&e);
+        cv.wait(lock, [&] { return 0 == e.helpers; });
     }
+
+    // Called by an idle thread, which doesn't have anything else to do
+    // Helps the running conversions until all the threads are idle
+    void help() {
+        unique_lock<mutex> lock(mtx);
+        busy--;
+        cv.notify_all();
+        for (;;) {
+            cv.wait(lock, [&] { return !active.empty() || !busy; });
+            if (active.empty())
+                return;
+            // The one with the fewest helpers
+            entry *e = active.front();
+            for (auto a : active)
+                if (a->helpers < e->helpers)
+                    e = a;
+            e->helpers++;
+            lock.unlock();
+            e->work();
+            lock.lock();
+            // Nothing left to convert for this one
+            active.remove(e);
+            e->helpers--;
+            cv.notify_all();
+        }
+    }
+
+    const int threads; // Total
+private:
+    mutex mtx;
+    condition_variable cv;
+    list<entry *> active;
+    int busy; // Threads which might start a conversion
 };
 
+// Reads, converts and writes all the tiles, returns an error message or empty
+// With more than one thread, reads and writes happen on their own threads, in order,
+// while the conversions run in parallel. At most depth tiles are in flight
+// With a board, idle threads from the board also convert tiles. Without an explicit depth,
+// the tiles in flight are then four per thread converting, including helpers
+static string transcode(reader_fn &rd, writer_fn &wr, bool reverse,
+    int threads = 1, size_t depth = 0, helper_board *board = nullptr)
+{
+    const string conv_err(reverse ? "Error decoding JXL" : "Error encoding JXL");
+    const string read_err("Failed to read input tile");
+    if (threads < 2 && !board) {
+        tile_job job;
+        int r;
+        while (0 < (r = rd(job))) {
+            convert(job, reverse);  // Reuses the output buffer
+            if (!job.ok) {
+                cerr << "Location " << hex << job.offset << " size " << job.size << endl;
+                return conv_err;
+            }
+            if (!wr(job))
+                return "Error writing data";
+        }
+        return r ? read_err : string();
+    }
+
+    enum { FREE, READY, DONE };
+    threads = max(threads, 1);
+    int share = board ? max(threads, board->threads) : threads;
+    // Four per thread by default, never fewer than the threads
+    size_t given = depth;
+    if (!depth)
+        depth = 4 * share;
+    depth = max(depth, static_cast<size_t>(share));
+    vector<tile_job> slots(depth);
+    // Last in, first out, so only as many slots as the most tiles in flight get used
+    vector<tile_job *> free_slots;
+    for (size_t i = depth; i > 0; i--) {
+        slots[i - 1].state = FREE;
+        free_slots.push_back(&slots[i - 1]);
+    }
+
+    mutex mtx;
+    condition_variable cv;
+    deque<tile_job *> work;  // Read, waiting for conversion
+    deque<tile_job *> order; // Read and not yet written, in read order
+    size_t in_flight = 0;    // Slots not free
+    size_t maxsz = 0;        // Largest output tile so far
+    bool eof = false;        // Reader is done
+    string error;            // Set on failure, stops everything
+    helper_board::entry help;
+
+    // Tiles in flight, depends on the helpers converting tiles
+    auto limit = [&]() -> size_t {
+        if (!board)
+            return depth;
+        size_t converting = threads + help.helpers;
+        return min(depth, given ? max(given, converting) : 4 * converting);
+    };
+
+    thread reader([&] {
+        for (;;) {
+            tile_job *j;
+            {
+                unique_lock<mutex> lock(mtx);
+                cv.wait(lock, [&] { return !error.empty() || (!free_slots.empty() && in_flight < limit()); });
+                if (!error.empty())
+                    break;
+                j = free_slots.back();
+                free_slots.pop_back();
+                in_flight++;
+            }
+            int r = rd(*j); // The slot is owned by the reader
+            lock_guard<mutex> lock(mtx);
+            if (r <= 0) {
+                if (r < 0 && error.empty())
+                    error = read_err;
+                free_slots.push_back(j);
+                in_flight--;
+                eof = true;
+                cv.notify_all();
+                break;
+            }
+            j->state = READY;
+            work.push_back(j);
+            order.push_back(j);
+            cv.notify_all();
+        }
+    });
+
+    auto work_loop = [&] {
+        for (;;) {
+            tile_job *j;
+            size_t reserve;
+            {
+                unique_lock<mutex> lock(mtx);
+                cv.wait(lock, [&] { return !error.empty() || !work.empty() || eof; });
+                if (!error.empty() || work.empty())
+                    return;
+                j = work.front();
+                work.pop_front();
+                reserve = maxsz;
+            }
+            convert(*j, reverse, reserve);
+            lock_guard<mutex> lock(mtx);
+            maxsz = max(maxsz, j->output.size());
+            j->state = DONE;
+            cv.notify_all();
+        }
+    };
+
+    vector<thread> workers;
+    for (int i = 0; i < threads; i++)
+        workers.emplace_back(work_loop);
+    if (board) {
+        help.work = [&] {
+            // One more helper, the reader can have more tiles in flight
+            {
+                lock_guard<mutex> lock(mtx);
+                cv.notify_all();
+            }
+            work_loop();
+        };
+        board->join(help);
+    }
+
+    // Write on this thread, in the read order
+    for (;;) {
+        tile_job *j;
+        {
+            unique_lock<mutex> lock(mtx);
+            cv.wait(lock, [&] {
+                return !error.empty() || (!order.empty() && DONE == order.front()->state)
+                    || (eof && order.empty()); });
+            if (!error.empty() || order.empty())
+                break;
+            j = order.front();
+            order.pop_front();
+        }
+        string err;
+        if (!j->ok) {
+            cerr << "Location " << hex << j->offset << " size " << j->size << endl;
+            err = conv_err;
+        }
+        else if (!wr(*j)) {
+            err = "Error writing data";
+        }
+        lock_guard<mutex> lock(mtx);
+        if (!err.empty() && error.empty())
+            error = err;
+        j->state = FREE;
+        free_slots.push_back(j);
+        in_flight--;
+        cv.notify_all();
+    }
+
+    if (board)
+        board->leave(help);
+    reader.join();
+    for (auto &t : workers)
+        t.join();
+    return error;
+}
+
 // Single file, either JXL or JFIF
 int single_to_jxl(const string &inname, bool reverse = false) {
     auto outname = inname + (reverse ? ".jfif" : ".jxl");
-    auto fin = fopen(inname.c_str(), "rb");
-    if (!fin) return Usage("Can't open input file");
-    fseek(fin, 0, SEEK_END);
-    auto insize = ftell(fin);
-    rewind(fin);
-    // Check a max size of 128MB
-    if (insize > (1ull << 27)) return Usage("Input file too large, limit is 128MB");
-    auto input = vector<uint8_t>(insize);
-    fread(input.data(), insize, 1, fin);
-    fclose(fin);
+    mapped_file input;
+    auto err = input.open(inname);
+    if (!err.empty()) return Usage(err);
     auto fout = fopen(outname.c_str(), "wb");
     if (!fout) return Usage("Can't open output file");
-    // Convert
-    vector<uint8_t> tilebuf;
-    int result = reverse ?
-        DecodeBrunsli(insize, input.data(), &tilebuf, (DecodeBrunsliSink)out_fun)
-        : EncodeBrunsli(insize, input.data(), &tilebuf, (DecodeBrunsliSink)out_fun);
+    setvbuf(fout, nullptr, _IOFBF, BUFSZ);
+    // Convert, output goes straight to the file
+    jxl_tile::sink out = { file_fun, fout };
+    int result = jxl_tile::convert_tile(jxl_tile::span(input.data, input.size), out,
+        reverse ? jxl_tile::TO_JPEG : jxl_tile::TO_JXL);
+    if (fclose(fout)) result = 0;
     if (!result) return Usage(reverse ? "Error decoding JXL" : "Error encoding JXL");
-    fwrite(tilebuf.data(), tilebuf.size(), 1, fout);
-    fclose(fout);
     return 0;
 }
 
+// Progress of mrf_to_jxl, everything before it is in the output files
+// The position is the next input index entry, or the next tile in data file order when sorted
+struct checkpoint {
+    uint64_t insize;
+    int sorted;
+    int reverse;
+    uint64_t position;
+    uint64_t ooff;      // Output data file size
+
+    bool load(const string &fname) {
+        ifstream f(fname);
+        string sig;
+        return f >> sig >> insize >> sorted >> reverse >> position >> ooff && sig == "jxl_checkpoint";
+    }
+
+    // Replaces the checkpoint file atomically
+    bool save(const string &fname) const {
+        string tmpname(fname + ".tmp");
+        FILE *f = fopen(tmpname.c_str(), "w");
+        if (!f)
+            return false;
+        bool ok = fprintf(f, "jxl_checkpoint %llu %d %d %llu %llu\n",
+            (unsigned long long)insize, sorted, reverse,
+            (unsigned long long)position, (unsigned long long)ooff) > 0;
+        ok = !fflush(f) && !fsync(fileno(f)) && ok;
+        ok = !fclose(f) && ok;
+        return ok && !rename(tmpname.c_str(), fname.c_str());
+    }
+};
+
 // From MRF, separate files, inname is the data file
-int mrf_to_jxl(const string &inname, const string &outname, bool reverse = false) {
+// When sorted is set, the tiles are read in the data file order and written in the same order
+// With an interval, in seconds, a checkpoint is saved periodically and a previous checkpoint
+// is used to resume the conversion. The output files are truncated to the checkpoint
+int mrf_to_jxl(const string &inname, const string &outname, bool reverse = false,
+    int threads = 1, size_t depth = 0, bool sorted = false, int interval = 0)
+{
     // Assume three letter data file extension
     if ('.' != inname[inname.size() - 4])
         return Usage("Expect mrf data file with three letter file name extension");
 
-    struct stat statb;
-    if (stat(inname.c_str(), &statb)) 
-        return Usage("Can't stat input file");
-    auto insize = statb.st_size;
+    mapped_file input;
+    auto err = input.open(inname);
+    if (!err.empty())
+        return Usage(err);
+    auto insize = input.size;
 
     // Indes should be same file with extension changed
     string inidxname(inname);
@@ -115,59 +414,191 @@ int mrf_to_jxl(const string &inname, const string &outname, bool reverse = false
     inidxname += "idx";
     // cout << "Opening " << inname << " and " << inidxname << endl;
     auto finidx = fopen(inidxname.c_str(), "rb");
-    auto fin = fopen(inname.c_str(), "rb");
-    if (!finidx || !fin)
-        return Usage("Can't open input data or index file");
+    if (!finidx)
+        return Usage("Can't open input index file");
     
+    // A checkpoint is only used when resuming with the same options
+    string ckname(outname + ".ckpt");
+    checkpoint ck = { static_cast<uint64_t>(insize), sorted, reverse, 0, 0 };
+    bool resume = false;
+    if (interval > 0) {
+        checkpoint saved;
+        if (saved.load(ckname)) {
+            if (saved.insize != ck.insize || saved.sorted != ck.sorted || saved.reverse != ck.reverse)
+                return Usage("Checkpoint " + ckname + " is for a different input or options");
+            ck = saved;
+            resume = true;
+        }
+    }
+    else {
+        unlink(ckname.c_str()); // Stale
+    }
+
     string outidxname(outname.substr(0, outname.size() - 4) + ".idx");
     // cout << "Opening " << outname << " and " << outidxname << endl;
-    auto fout = fopen(outname.c_str(), "wb");
-    auto foutidx = fopen(outidxname.c_str(), "wb");
-    tinfo tile;
-    vector<uint8_t> input;
-    vector<uint8_t> tilebuf;
+    auto fout = fopen(outname.c_str(), resume ? "r+b" : "wb");
+    auto foutidx = fopen(outidxname.c_str(), resume ? "r+b" : "wb");
+    if (!fout || !foutidx)
+        return Usage("Can't open output data or index file");
     uint64_t ooff = 0;
+    uint64_t nidx = 0;     // Input index entries read
+    uint64_t oidx = 0;     // Output index entries written
+
+    // Drop the output written after the checkpoint
+    if (resume) {
+        FSEEK(fout, 0, SEEK_END);
+        if (static_cast<uint64_t>(FTELL(fout)) < ck.ooff)
+            return Usage("Output data file is shorter than the checkpoint");
+        ooff = ck.ooff;
+        if (ftruncate(fileno(fout), ooff) || FSEEK(fout, ooff, SEEK_SET))
+            return Usage("Can't truncate output data file");
+        if (!sorted) {
+            // The index entries are written in order, the next one is at the position
+            nidx = oidx = ck.position;
+            if (ftruncate(fileno(foutidx), oidx * sizeof(tinfo))
+                || FSEEK(foutidx, oidx * sizeof(tinfo), SEEK_SET)
+                || FSEEK(finidx, nidx * sizeof(tinfo), SEEK_SET))
+                return Usage("Can't resume index files");
+        }
+        cerr << "Resuming from " << (sorted ? "tile " : "index entry ") << ck.position
+            << ", output offset " << ooff << endl;
+    }
+    auto next_ckpt = chrono::steady_clock::now() + chrono::seconds(interval);
 
     // Stats, saving ratio
     double min_rat = 1;
     double max_rat = -100;
-    while (fread(&tile, sizeof(tile), 1, finidx)) {
-        tile.toh();
-        if (tile.size) {
-            fseek(fin, tile.offset, SEEK_SET);
-            input.resize(tile.size);
-            if (!fread(input.data(), tile.size, 1, fin)) {
-                cerr << "Location " << hex << tile.offset << " size " << tile.size << endl;
-                return Usage("Failed to read input tile");
+
+    // Existing tiles, in data file order, only used when sorted
+    vector<ranked_index<tinfo>> tiles;
+    size_t rpos = 0; // Next tile to be read, in tiles
+    size_t wpos = 0; // Next tile to be written, in tiles
+    if (sorted) {
+        vector<tinfo> chunk(BUFSZ / sizeof(tinfo));
+        size_t n;
+        while (0 != (n = fread(chunk.data(), sizeof(tinfo), chunk.size(), finidx))) {
+            for (size_t i = 0; i < n; i++, nidx++) {
+                chunk[i].toh();
+                if (chunk[i].size)
+                    tiles.emplace_back(chunk[i], nidx);
             }
-            tilebuf.clear();
-
-            int result = reverse ?
-                DecodeBrunsli(tile.size, input.data(), &tilebuf, (DecodeBrunsliSink)out_fun)
-                : EncodeBrunsli(tile.size, input.data(), &tilebuf, (DecodeBrunsliSink)out_fun);
-            if (!result) {
-                cerr << "Location " << hex << tile.offset << " size " << tile.size << endl;
-                return Usage(reverse ? "Error decoding JXL" : "Error encoding JXL");
+        }
+        sort(tiles.begin(), tiles.end());
+        // The data file is now read front to back
+        input.advise(MADV_SEQUENTIAL);
+        if (resume)
+            rpos = wpos = ck.position;
+    }
+    else {
+        input.advise(MADV_RANDOM);
+    }
+
+    // Only the existing tiles go through the pipeline
+    reader_fn rd = [&](tile_job &job) {
+        tinfo tile;
+        if (sorted) {
+            if (rpos == tiles.size())
+                return 0;
+            tile = tiles[rpos].idx;
+            job.rank = tiles[rpos++].rank;
+        }
+        else {
+            do {
+                if (!fread(&tile, sizeof(tile), 1, finidx))
+                    return 0;
+                nidx++;
+                tile.toh();
+            } while (!tile.size);
+            job.rank = nidx - 1;
+        }
+        if (!input.contains(tile.offset, tile.size)) {
+            cerr << "Location " << hex << tile.offset << " size " << tile.size << endl;
+            return -1;
+        }
+        // Conversion happens later, on another thread if multithreaded
+        if (!sorted)
+            input.prefetch(tile.offset, tile.size);
+        job.offset = tile.offset;
+        job.size = tile.size;
+        job.data = input.data + tile.offset;
+        return 1;
+    };
+
+    // Everything written so far goes to disk before the checkpoint
+    auto save_checkpoint = [&]() {
+        ck.position = sorted ? wpos : oidx;
+        ck.ooff = ooff;
+        return !fflush(fout) && !fflush(foutidx) && !fdatasync(fileno(fout))
+            && !fdatasync(fileno(foutidx)) && ck.save(ckname);
+    };
+
+    writer_fn wr = [&](tile_job &job) {
+        if (interval > 0 && chrono::steady_clock::now() >= next_ckpt) {
+            if (!save_checkpoint()) {
+                cerr << "Can't save checkpoint " << ckname << endl;
+                return false;
             }
+            next_ckpt = chrono::steady_clock::now() + chrono::seconds(interval);
+        }
 
-            double rat = 1 - double(tilebuf.size()) / tile.size;
-            min_rat = min(rat, min_rat);
-            max_rat = max(rat, max_rat);
+        tinfo tile;
+        double rat = 1 - double(job.output.size()) / job.size;
+        min_rat = min(rat, min_rat);
+        max_rat = max(rat, max_rat);
 
-            // Prepare the output tinfo
-            tile.offset = ooff;
-            tile.size = tilebuf.size();
-            ooff += tile.size;
-            if (!fwrite(tilebuf.data(), tilebuf.size(), 1, fout))
-                return Usage("Error writing data");
+        // Prepare the output tinfo
+        tile.offset = ooff;
+        tile.size = job.output.size();
+        ooff += tile.size;
+        if (!fwrite(job.output.data(), job.output.size(), 1, fout))
+            return false;
+
+        // Index is written at the end, unless checkpointing, a restart needs the entries
+        if (sorted && interval <= 0) {
+            tiles[wpos++].idx = tile;
+            return true;
         }
+        if (sorted)
+            wpos++;
+
+        // Skip the empty index entries, leaving holes
+        if (oidx != job.rank)
+            fseek(foutidx, job.rank * sizeof(tile), SEEK_SET);
         tile.ton();
-        fwrite(&tile, sizeof(tile), 1, foutidx);
+        oidx = job.rank + 1;
+        return 0 != fwrite(&tile, sizeof(tile), 1, foutidx);
+    };
+
+    err = transcode(rd, wr, reverse, threads, depth);
+    if (err.empty() && sorted && interval <= 0) {
+        // Write the index in tile order, leaving holes
+        sort(tiles.begin(), tiles.end(), ranked_index<tinfo>::by_rank);
+        for (auto &t : tiles) {
+            if (oidx != t.rank)
+                fseek(foutidx, t.rank * sizeof(tinfo), SEEK_SET);
+            t.idx.ton();
+            oidx = t.rank + 1;
+            if (!fwrite(&t.idx, sizeof(tinfo), 1, foutidx)) {
+                err = "Error writing index";
+                break;
+            }
+        }
+    }
+    if (err.empty()) {
+        // Output index has the same size as the input one
+        fseek(foutidx, nidx * sizeof(tinfo), SEEK_SET);
+        if (ftruncate(fileno(foutidx), nidx * sizeof(tinfo)))
+            err = "Error writing index";
     }
-    fclose(fin);
     fclose(finidx);
-    fclose(fout);
-    fclose(foutidx);
+    if (fclose(fout) && err.empty())
+        err = "Error writing data";
+    if (fclose(foutidx) && err.empty())
+        err = "Error writing index";
+    if (!err.empty())
+        return Usage(err);
+    if (interval > 0)
+        unlink(ckname.c_str()); // Done
 
     cerr << "Used to be " << insize << " now " << ooff << ", saved " << (1 - double(ooff)/insize) * 100 << "%\n";
     cerr << "Individual tile saving between " << min_rat * 100 << "% and " << max_rat * 100 << "%\n";
@@ -175,121 +606,287 @@ int mrf_to_jxl(const string &inname, const string &outname, bool reverse = false
     return 0;
 }
 
-int bundle_to_jxl(const string &inname, const string &outname, bool reverse = false) {
-
-    struct stat statb;
-    if (stat(inname.c_str(), &statb)) 
-        return Usage("Can't stat input file");
-    auto insize = statb.st_size;
-    if (insize < (HDRSZ + IDXSZ))
-        return Usage("Input file too small, can't be a bundle");
-    // cerr << "Size is " << insize << endl;
-    int infd = open(inname.c_str(), O_RDONLY);
-    if (infd < 0) return Usage("Can't open input file");
-    auto input = reinterpret_cast<const unsigned char *>(
-        mmap(nullptr, insize, PROT_READ, MAP_SHARED, infd, 0));
-    close(infd);
-    if (MAP_FAILED == input) {
-        cerr << "ERROR: " << strerror(errno) << endl;
-        return Usage("Can't mmap input file");
-    }
-
-    // TODO: define header as struct
-    char header[64];
-    memcpy(header, input, HDRSZ);
+// Brunsli stream signature
+static const uint8_t JXL_SIG[] = { 0x0a, 0x04, 0x42, 0xd2, 0xd5, 0x4e };
 
-    // Read index
-    vector<bundle_index> idx(BSZ2);
-    memcpy(idx.data(), input + HDRSZ, IDXSZ);
+// True if the tile is already in the output format
+static bool converted(const uint8_t *data, size_t size, bool reverse) {
+    if (reverse)
+        return size >= 2 && data[0] == 0xff && data[1] == 0xd8;
+    return size >= sizeof(JXL_SIG) && !memcmp(data, JXL_SIG, sizeof(JXL_SIG));
+}
+
+// Results of a bundle conversion
+struct conv_stats {
+    conv_stats() : insize(0), outsize(0), maxsz(0), min_rat(1), max_rat(-100), skipped(false) {}
+    uint64_t insize;
+    uint64_t outsize;
+    uint64_t maxsz;
+    double min_rat; // Saving ratio
+    double max_rat;
+    bool skipped;   // Already converted
+};
 
-    // TODO: Swap after reading if not little endian
+// Convert a bundle, returns an error message or empty
+// The output is written to a temporary file which is then renamed, so outname can be inname.
+// Readers of outname see either the old or the new bundle. The bundle is skipped if the
+// first tile is already in the output format
+static string convert_bundle(const string &inname, const string &outname, bool reverse,
+    int threads, size_t depth, conv_stats &stats, helper_board *board = nullptr)
+{
+    mapped_file in_map;
+    auto err = in_map.open(inname);
+    if (!err.empty())
+        return err;
+    stats.insize = in_map.size;
+    auto input = in_map.data;
+
+    bundle_header header;
+    memset(&header, 0, sizeof(header));
+    if (in_map.size >= bundle::HDRSZ) {
+        memcpy(&header, input, bundle::HDRSZ);
+        header.toh();
+    }
+    err = header.check(in_map.size);
+    if (!err.empty())
+        return err;
+
+    // Read index
+    vector<bundle_index> idx(bundle::BSZ2);
+    memcpy(idx.data(), input + bundle::HDRSZ, bundle::IDXSZ);
 
     // Check for out of bounds
-    for (auto &v : idx) 
-        if ((v.offset + v.size) > insize)
-            return Usage("Corrupt index");
+    size_t first = idx.size(); // First tile
+    for (size_t i = 0; i < idx.size(); i++) {
+        if (!in_map.contains(idx[i].offset(), idx[i].size()))
+            return "Corrupt index";
+        if (idx[i].size() && first == idx.size())
+            first = i;
+    }
+    if (first < idx.size() && converted(input + idx[first].offset(), idx[first].size(), reverse)) {
+        stats.skipped = true;
+        return string();
+    }
 
     // Prepare output
-    FILE *out = fopen(outname.c_str(), "wb");
-    if (!out) return Usage("Can't open output file");
+    string tmpname(outname + ".tmp");
+    FILE *out = fopen(tmpname.c_str(), "wb");
+    if (!out)
+        return "Can't open output file";
+    setvbuf(out, nullptr, _IOFBF, BUFSZ);
     // Write the input header + index, to have the right placement
-    size_t ooff = HDRSZ + IDXSZ;
-    fwrite(input, ooff, 1, out);
-
-    // Convert, writing output as we go, reusing the index
-    vector<uint8_t> tilebuf; // output holder
-    size_t maxsz = 0;
-    // Stats, saving ratio
-    double min_rat = 1;
-    double max_rat = -100;
+    uint64_t ooff = bundle::HDRSZ + bundle::IDXSZ;
+    if (!fwrite(input, ooff, 1, out)) {
+        fclose(out);
+        unlink(tmpname.c_str());
+        return "Error writing output file";
+    }
 
-    for (auto &v : idx) {
-        if (!v.size) continue;
-        tilebuf.clear();
-        int result = reverse ?
-            DecodeBrunsli(v.size, &input[v.offset], &tilebuf, (DecodeBrunsliSink)out_fun)
-            : EncodeBrunsli(v.size, &input[v.offset], &tilebuf, (DecodeBrunsliSink)out_fun);
-        if (!result) {
-            cerr << "Location " << hex << v.offset << " size " << v.size << endl;
-            return Usage(reverse ? "Error decoding JXL" : "Error encoding JXL");
-        }
+    size_t next = 0; // Next index entry to read
+    reader_fn rd = [&](tile_job &job) {
+        while (next < idx.size() && !idx[next].size())
+            next++;
+        if (next == idx.size())
+            return 0;
+        job.rank = next;
+        job.offset = idx[next].offset();
+        job.size = idx[next].size();
+        job.data = &input[job.offset];
+        in_map.prefetch(job.offset, job.size);
+        next++;
+        return 1;
+    };
 
+    // Convert, writing output as we go, reusing the index
+    writer_fn wr = [&](tile_job &job) {
         // This has to be 3 bytes or smaller, check anyhow
-        uint32_t tilesz = tilebuf.size();
-        if (tilesz >= (1 << 24) || static_cast<size_t>(tilesz) != tilebuf.size()) {
-            cerr << "Location " << hex << v.offset << " size " << v.size << 
-                " converted to " << tilebuf.size() << endl;
-            return Usage("Output tile size too big");
+        if (job.output.size() > bundle_index::MAX_SIZE) {
+            cerr << "Location " << hex << job.offset << " size " << job.size << 
+                " converted to " << job.output.size() << endl;
+            cerr << "Output tile size too big\n";
+            return false;
+        }
+        if (ooff + 4 > bundle_index::OFFSET_MASK) {
+            cerr << "Output bundle too big\n";
+            return false;
         }
         // Looks good, write the output tile, prefixed by size
-        fwrite(&tilesz, 4, 1, out);
-        fwrite(tilebuf.data(), tilesz, 1, out);
+        uint32_t tilesz = static_cast<uint32_t>(job.output.size());
+        uint32_t prefix = htole32(tilesz);
+        if (!fwrite(&prefix, 4, 1, out) || !fwrite(job.output.data(), tilesz, 1, out))
+            return false;
 
         // Collect stats
-        maxsz = max(maxsz, static_cast<size_t>(tilesz));
-        double rat = 1 - double(tilesz) / v.size;
-        min_rat = min(rat, min_rat);
-        max_rat = max(rat, max_rat);
+        stats.maxsz = max(stats.maxsz, static_cast<uint64_t>(tilesz));
+        double rat = 1 - double(tilesz) / job.size;
+        stats.min_rat = min(rat, stats.min_rat);
+        stats.max_rat = max(rat, stats.max_rat);
 
-        // Modify the index in place
-        v.offset = ooff + 4; // Points to first byte of tile data, not the size prefix
-        v.size = tilesz;
+        // Modify the index in place, points to first byte of tile data, not the size prefix
+        idx[job.rank].set(ooff + 4, tilesz);
         ooff += 4 + tilesz;
+        return true;
+    };
+
+    err = transcode(rd, wr, reverse, threads, depth, board);
+    if (err.empty()) {
+        // Go back, write the new header and index
+        header.max_record = static_cast<uint32_t>(stats.maxsz);
+        header.file_size = ooff;
+        header.tole();
+        fseek(out, 0, SEEK_SET);
+        if (!fwrite(&header, bundle::HDRSZ, 1, out) || !fwrite(idx.data(), bundle::IDXSZ, 1, out)
+            || fflush(out) || fsync(fileno(out)))
+            err = "Error writing output file";
     }
-    // Done with the input
-    munmap((void *)input, insize);
+    if (fclose(out) && err.empty())
+        err = "Error writing output file";
+    if (err.empty() && rename(tmpname.c_str(), outname.c_str()))
+        err = "Can't rename output file";
+    if (!err.empty()) {
+        unlink(tmpname.c_str());
+        return err;
+    }
+    stats.outsize = ooff;
+    return string();
+}
 
-    // Go back, write the new header and index
-    fseek(out, 0, SEEK_SET);
-    
-    // TODO: Figure out the header stuff
-    // Modify maxtilesize and file size
-    memcpy(header + 8, &maxsz, 4); // Assume little endian
-    memcpy(header + 24, &ooff, sizeof(ooff));
-    fwrite(header, HDRSZ, 1, out);
-
-    fwrite(idx.data(), IDXSZ, 1, out);
-    fclose(out);
-    cerr << "Used to be " << insize << " now " << ooff << ", saved " << (1 - double(ooff)/insize) * 100 << "%\n";
-    cerr << "Individual tile saving between " << min_rat * 100 << "% and " << max_rat * 100 << "%\n";
-    cerr << "Maxtile " << maxsz << endl;
+int bundle_to_jxl(const string &inname, const string &outname, bool reverse = false,
+    int threads = 1, size_t depth = 0)
+{
+    conv_stats stats;
+    auto err = convert_bundle(inname, outname, reverse, threads, depth, stats);
+    if (!err.empty())
+        return Usage(err);
+    if (stats.skipped) {
+        cerr << inname << " is already converted\n";
+        return 0;
+    }
+    cerr << "Used to be " << stats.insize << " now " << stats.outsize << ", saved "
+        << (1 - double(stats.outsize) / stats.insize) * 100 << "%\n";
+    cerr << "Individual tile saving between " << stats.min_rat * 100 << "% and " << stats.max_rat * 100 << "%\n";
+    cerr << "Maxtile " << stats.maxsz << endl;
     return 0;
 }
 
+// Adds the .bundle files under a directory to bundles, with their size
+static void find_bundles(const string &dirname, vector<pair<uint64_t, string>> &bundles) {
+    DIR *dir = opendir(dirname.c_str());
+    if (!dir) {
+        cerr << "Can't read directory " << dirname << endl;
+        return;
+    }
+    const string ext(".bundle");
+    while (auto entry = readdir(dir)) {
+        string name(entry->d_name);
+        if (name == "." || name == "..")
+            continue;
+        string path(dirname + "/" + name);
+        struct stat statb;
+        if (lstat(path.c_str(), &statb))
+            continue;
+        if (S_ISDIR(statb.st_mode))
+            find_bundles(path, bundles);
+        else if (S_ISREG(statb.st_mode) && name.size() > ext.size()
+            && !name.compare(name.size() - ext.size(), ext.size(), ext))
+            bundles.emplace_back(statb.st_size, path);
+    }
+    closedir(dir);
+}
+
+// Converts all the bundles in a directory tree, on multiple threads, the largest bundles first
+// Each thread converts one bundle at a time. The threads not needed for bundles, because there are
+// fewer bundles than threads or because none are left, convert the tiles of the bundles still
+// running. At most depth tiles per bundle are in flight
+int dir_to_jxl(const string &dirname, bool reverse = false, bool inplace = false,
+    int threads = 1, size_t depth = 0)
+{
+    vector<pair<uint64_t, string>> bundles;
+    find_bundles(dirname, bundles);
+    if (bundles.empty())
+        return Usage("No bundles found in " + dirname);
+    sort(bundles.rbegin(), bundles.rend());
+
+    threads = max(threads, 1);
+    atomic<size_t> next(0);
+    helper_board board(threads);
+
+    // Totals, for the report
+    mutex mtx;
+    uint64_t insize = 0, outsize = 0;
+    size_t done = 0, skipped = 0, failed = 0;
+
+    auto worker = [&] {
+        for (size_t i = next++; i < bundles.size(); i = next++) {
+            const string &name = bundles[i].second;
+            conv_stats stats;
+            auto err = convert_bundle(name, inplace ? name : name + ".jxl", reverse,
+                1, depth, stats, threads > 1 ? &board : nullptr);
+            lock_guard<mutex> lock(mtx);
+            if (!err.empty()) {
+                cerr << name << ": " << err << endl;
+                failed++;
+            }
+            else if (stats.skipped) {
+                skipped++;
+            }
+            else {
+                done++;
+                insize += stats.insize;
+                outsize += stats.outsize;
+            }
+        }
+        board.help();
+    };
+
+    vector<thread> pool;
+    for (int i = 1; i < threads; i++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+
+    cerr << "Converted " << done << " bundles, skipped " << skipped << " already converted, "
+        << failed << " failed\n";
+    if (insize)
+        cerr << "Used to be " << insize << " now " << outsize << ", saved "
+            << (1 - double(outsize) / insize) * 100 << "%\n";
+    return failed ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
     bool reverse = false; // default to JPEG -> JXL
     bool bundle = false;  // default to MRF
     bool single = false;  // single jpeg
+    int threads = 1;
+    size_t depth = 0;     // Tiles in flight, picked by transcode
+    bool sorted = false;  // MRF tiles in data file order
+    bool inplace = false; // Replace the input bundles
+    int interval = 0;     // Checkpoint interval, in seconds
     string input_name;
-    while(--argc) {
-        string this_arg(argv[argc]);
+    for (int i = 1; i < argc; i++) {
+        string this_arg(argv[i]);
         if (this_arg == "-r") {
             reverse = true;
         } else if (this_arg == "-b") {
             bundle = true;
         } else if (this_arg == "-s") {
             single = true;
+        } else if (this_arg == "-j" && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads <= 0)
+                threads = max(1u, thread::hardware_concurrency());
+        } else if (this_arg == "-c" && i + 1 < argc) {
+            interval = atoi(argv[++i]);
+            if (interval <= 0)
+                return Usage("Checkpoint interval has to be positive");
+        } else if (this_arg == "-i") {
+            inplace = true;
+        } else if (this_arg == "-o") {
+            sorted = true;
+        } else if (this_arg == "-m" && i + 1 < argc) {
+            depth = strtoull(argv[++i], nullptr, 0);
         } else {
             input_name = this_arg;
         }
@@ -300,7 +897,12 @@ int main(int argc, char **argv)
     
     if (single)
         return single_to_jxl(input_name, reverse);
-    if (bundle)
-        return bundle_to_jxl(input_name, input_name + ".jxl", reverse);
-    return mrf_to_jxl(input_name, input_name + ".jxl", reverse);
-}
\ No newline at end of file
+    if (bundle) {
+        struct stat statb;
+        if (!stat(input_name.c_str(), &statb) && S_ISDIR(statb.st_mode))
+            return dir_to_jxl(input_name, reverse, inplace, threads, depth);
+        return bundle_to_jxl(input_name, inplace ? input_name : input_name + ".jxl",
+            reverse, threads, depth);
+    }
+    return mrf_to_jxl(input_name, input_name + ".jxl", reverse, threads, depth, sorted, interval);
+}
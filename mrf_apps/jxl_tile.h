@@ -0,0 +1,201 @@
+/*
+ * file: jxl_tile.h
+ *
+ * Purpose:
+ *
+ * Conversion of single tiles between JFIF-JPEG and JPEG-XL (brunsli), used by jxl for
+ * whole MRFs and bundles, and usable by a tile server that stores only the JXL tiles
+ * and reconstructs the JPEG tiles on request.
+ *
+ * Brunsli keeps no state between calls, a conversion only needs an output buffer.
+ * The arena_pool holds reusable output buffers, so converting a tile doesn't allocate
+ * once the buffers have grown to the tile size. The tile_cache keeps the recently
+ * converted tiles, up to a byte limit, and is shared by all the threads.
+ *
+ * Usage:
+ *
+ *   jxl_tile::tile_cache cache(64 * 1024 * 1024);
+ *   auto jpeg = cache.get(key, jxl_tile::span(data, size));
+ *   if (jpeg) send(jpeg->data(), jpeg->size());
+ *
+ * The key identifies the tile for the caller, for example the tile offset in the data file.
+ * Link with the brunsli encoder and decoder libraries
+ */
+
+#if !defined(JXL_TILE_H)
+#define JXL_TILE_H
+
+#include <brunsli/encode.h>
+#include <brunsli/decode.h>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <algorithm>
+
+namespace jxl_tile {
+
+enum direction { TO_JXL, TO_JPEG };
+
+// Input tile
+struct span {
+    span(const uint8_t *data = nullptr, size_t size = 0) : data(data), size(size) {}
+    const uint8_t *data;
+    size_t size;
+};
+
+// Receives the converted tile in parts, returns the number of bytes taken
+// Taking fewer bytes than given stops the conversion
+struct sink {
+    DecodeBrunsliSink fn;
+    void *context;
+};
+
+// Reusable output buffer, grows as needed and never shrinks
+struct arena {
+    arena() : used(0) {}
+    void clear() { used = 0; }
+    void reserve(size_t sz) {
+        if (buf.size() < sz)
+            buf.resize(sz);
+    }
+    const uint8_t *data() const { return buf.data(); }
+    size_t size() const { return used; }
+    std::vector<uint8_t> buf;
+    size_t used;
+};
+
+// Brunsli sink, appends to an arena
+inline size_t arena_fun(void *context, const uint8_t *data, size_t size) {
+    arena *output = static_cast<arena *>(context);
+    if (output->used + size > output->buf.size())
+        output->reserve(std::max(2 * output->buf.size(), output->used + size));
+    memcpy(output->buf.data() + output->used, data, size);
+    output->used += size;
+    return size;
+}
+
+// Returns false if the input is not a valid tile of the source format, or if the sink fails
+inline bool convert_tile(span in, sink out, direction dir) {
+    return 0 != (dir == TO_JPEG ? DecodeBrunsli(in.size, in.data, out.context, out.fn)
+        : EncodeBrunsli(in.size, in.data, out.context, out.fn));
+}
+
+// Replaces the arena content, which is reserved to at least maxsz
+inline bool convert_tile(span in, arena &out, direction dir, size_t maxsz = 0) {
+    out.clear();
+    out.reserve(maxsz);
+    sink s = { arena_fun, &out };
+    return convert_tile(in, s, dir);
+}
+
+// Output buffers shared between threads, at most max_free are kept when returned
+class arena_pool {
+public:
+    explicit arena_pool(size_t max_free = 16) : max_free(max_free) {}
+
+    std::unique_ptr<arena> get() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (free.empty())
+            return std::unique_ptr<arena>(new arena);
+        auto a = std::move(free.back());
+        free.pop_back();
+        return a;
+    }
+
+    void put(std::unique_ptr<arena> a) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (free.size() < max_free)
+            free.push_back(std::move(a));
+    }
+
+private:
+    size_t max_free;
+    std::mutex mtx;
+    std::vector<std::unique_ptr<arena>> free;
+};
+
+typedef std::shared_ptr<const std::vector<uint8_t>> tile_ptr;
+
+// LRU cache of converted tiles, by key, thread safe
+// A tile stays valid while the caller holds it, even after it is evicted
+class tile_cache {
+public:
+    explicit tile_cache(size_t max_bytes, direction dir = TO_JPEG) :
+        max_bytes(max_bytes), dir(dir), bytes(0), nhits(0), nmisses(0) {}
+
+    // The converted tile, converting the input if it is not cached, null on conversion error
+    // Concurrent misses for the same key can convert the tile more than once
+    tile_ptr get(uint64_t key, span in) {
+        auto tile = find(key);
+        if (tile) {
+            nhits++;
+            return tile;
+        }
+        nmisses++;
+
+        // Convert outside of the lock
+        auto a = pool.get();
+        bool ok = convert_tile(in, *a, dir, maxsz);
+        if (ok) {
+            tile = std::make_shared<std::vector<uint8_t>>(a->data(), a->data() + a->size());
+            size_t sz = maxsz;
+            while (sz < a->size() && !maxsz.compare_exchange_weak(sz, a->size()))
+                ;
+        }
+        pool.put(std::move(a));
+        if (!ok)
+            return tile_ptr();
+        insert(key, tile);
+        return tile;
+    }
+
+    // Only if cached, otherwise null
+    tile_ptr find(uint64_t key) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = cache.find(key);
+        if (it == cache.end())
+            return tile_ptr();
+        lru.splice(lru.begin(), lru, it->second.first);
+        return it->second.second;
+    }
+
+    uint64_t hits() const { return nhits; }
+    uint64_t misses() const { return nmisses; }
+
+private:
+    void insert(uint64_t key, const tile_ptr &tile) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (cache.count(key) || tile->size() > max_bytes)
+            return;
+        lru.push_front(key);
+        cache[key] = std::make_pair(lru.begin(), tile);
+        bytes += tile->size();
+        while (bytes > max_bytes) {
+            auto last = cache.find(lru.back());
+            bytes -= last->second.second->size();
+            cache.erase(last);
+            lru.pop_back();
+        }
+    }
+
+    size_t max_bytes;
+    direction dir;
+    arena_pool pool;
+    std::atomic<size_t> maxsz = {0}; // Largest tile so far, reserved in the arenas
+    std::mutex mtx;
+    size_t bytes; // Held by the cache
+    std::list<uint64_t> lru; // Most recent first
+    std::unordered_map<uint64_t, std::pair<std::list<uint64_t>::iterator, tile_ptr>> cache;
+    std::atomic<uint64_t> nhits;
+    std::atomic<uint64_t> nmisses;
+};
+
+} // namespace jxl_tile
+
+#endif
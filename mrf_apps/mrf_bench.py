@@ -0,0 +1,389 @@
+#!/usr/bin/env python3
+#
+# Name: mrf_bench
+# Purpose:
+
+'''Throughput benchmarks for can, uncan and jxl, on synthetic inputs
+
+ Generates sparse MRF index files of several virtual sizes and densities, a set of
+ JPEG tiles stored as an MRF and as an esri bundle, then times the tools on them.
+ Reports the wall time, MB/s, tiles/s and peak memory of every run, and appends
+ the results to a JSON lines file, one object per run, so they can be compared over time.
+'''
+
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+import os
+import sys
+import json
+import math
+import time
+import random
+import struct
+import shutil
+import socket
+import argparse
+import tempfile
+import subprocess
+
+KB = 1024
+MB = KB * KB
+GB = MB * KB
+TB = GB * KB
+
+# Virtual index sizes and fractions of 512 byte blocks that hold entries
+INDEX_SIZES = (GB, 64 * GB, TB)
+DENSITIES = (0.0001, 0.001, 0.01, 0.1)
+# Consecutive blocks written together, tiles tend to be clustered
+CLUSTER = 8
+
+#
+# Minimal baseline grayscale JPEG encoder, used when PIL is not available
+#
+
+ZIGZAG = (0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63)
+
+# Annex K luminance quantization table, natural order
+QTABLE = (16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99)
+
+# Annex K luminance Huffman tables, code counts per length and values
+DC_BITS = (0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0)
+DC_VALS = tuple(range(12))
+AC_BITS = (0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d)
+AC_VALS = bytes.fromhex(
+    "01020300041105122131410613516107227114328191a1082342b1c11552d1f0"
+    "2433627282090a161718191a25262728292a3435363738393a434445464748494a"
+    "535455565758595a636465666768696a737475767778797a838485868788898a"
+    "92939495969798999aa2a3a4a5a6a7a8a9aab2b3b4b5b6b7b8b9bac2c3c4c5c6"
+    "c7c8c9cad2d3d4d5d6d7d8d9dae1e2e3e4e5e6e7e8e9eaf1f2f3f4f5f6f7f8f9fa")
+
+def huffman_codes(bits, vals):
+    '''Code and length for every value'''
+    codes = {}
+    code = 0
+    k = 0
+    for length in range(1, 17):
+        for _ in range(bits[length - 1]):
+            codes[vals[k]] = (code, length)
+            code += 1
+            k += 1
+        code <<= 1
+    return codes
+
+# DCT basis, with the scaling folded in
+DCT = [[(math.sqrt(0.5) if u == 0 else 1.0) / 2 * math.cos((2 * x + 1) * u * math.pi / 16)
+    for x in range(8)] for u in range(8)]
+
+class BitWriter:
+    def __init__(self):
+        self.out = bytearray()
+        self.acc = 0
+        self.nbits = 0
+
+    def write(self, code, length):
+        self.acc = (self.acc << length) | code
+        self.nbits += length
+        while self.nbits >= 8:
+            self.nbits -= 8
+            byte = (self.acc >> self.nbits) & 0xff
+            self.out.append(byte)
+            if byte == 0xff:
+                self.out.append(0) # Byte stuffing
+        self.acc &= (1 << self.nbits) - 1
+
+    def flush(self):
+        if self.nbits:
+            self.write((1 << (8 - self.nbits)) - 1, 8 - self.nbits)
+        return bytes(self.out)
+
+def encode_value(v):
+    '''Category and bits of a coefficient'''
+    cat = abs(v).bit_length()
+    return cat, (v if v >= 0 else v + (1 << cat) - 1)
+
+def jpeg_gray(pixels, width, height):
+    '''Encodes a grayscale image, width and height multiples of 8'''
+    dc_codes = huffman_codes(DC_BITS, DC_VALS)
+    ac_codes = huffman_codes(AC_BITS, AC_VALS)
+    bw = BitWriter()
+    pred = 0
+    for by in range(0, height, 8):
+        for bx in range(0, width, 8):
+            block = [[pixels[(by + y) * width + bx + x] - 128 for x in range(8)] for y in range(8)]
+            # Rows then columns
+            rows = [[sum(DCT[u][x] * block[y][x] for x in range(8)) for u in range(8)] for y in range(8)]
+            coef = [0] * 64
+            for v in range(8):
+                for u in range(8):
+                    f = sum(DCT[v][y] * rows[y][u] for y in range(8))
+                    coef[v * 8 + u] = int(round(f / QTABLE[v * 8 + u]))
+            zz = [coef[i] for i in ZIGZAG]
+            cat, bits = encode_value(zz[0] - pred)
+            pred = zz[0]
+            bw.write(*dc_codes[cat])
+            if cat:
+                bw.write(bits, cat)
+            run = 0
+            for v in zz[1:]:
+                if v == 0:
+                    run += 1
+                    continue
+                while run > 15:
+                    bw.write(*ac_codes[0xf0])
+                    run -= 16
+                cat, bits = encode_value(v)
+                bw.write(*ac_codes[(run << 4) | cat])
+                bw.write(bits, cat)
+                run = 0
+            if run:
+                bw.write(*ac_codes[0])
+    data = bw.flush()
+
+    def segment(marker, payload):
+        return struct.pack('>BBH', 0xff, marker, len(payload) + 2) + payload
+
+    out = b'\xff\xd8'
+    out += segment(0xe0, b'JFIF\0\x01\x01\0\0\x01\0\x01\0\0')
+    out += segment(0xdb, b'\0' + bytes(QTABLE[i] for i in ZIGZAG))
+    out += segment(0xc0, struct.pack('>BHHBBBB', 8, height, width, 1, 1, 0x11, 0))
+    out += segment(0xc4, b'\x00' + bytes(DC_BITS) + bytes(DC_VALS))
+    out += segment(0xc4, b'\x10' + bytes(AC_BITS) + AC_VALS)
+    out += segment(0xda, struct.pack('>BBBBBB', 1, 1, 0, 0, 63, 0))
+    return out + data + b'\xff\xd9'
+
+def synthetic_image(width, height, seed):
+    '''Smooth gradients with some noise, compresses like imagery'''
+    rnd = random.Random(seed)
+    fx, fy = rnd.uniform(0.01, 0.1), rnd.uniform(0.01, 0.1)
+    return [min(255, max(0, int(128 + 60 * math.sin(x * fx) * math.cos(y * fy) + rnd.gauss(0, 12))))
+        for y in range(height) for x in range(width)]
+
+def make_jpegs(count, size):
+    '''A few different JPEG tiles'''
+    try:
+        from PIL import Image
+        import io
+        tiles = []
+        for i in range(count):
+            img = Image.new('L', (size, size))
+            img.putdata(synthetic_image(size, size, i))
+            img = img.convert('RGB')
+            buf = io.BytesIO()
+            img.save(buf, format='JPEG', quality=75)
+            tiles.append(buf.getvalue())
+        return tiles
+    except ImportError:
+        return [jpeg_gray(synthetic_image(size, size, i), size, size) for i in range(count)]
+
+#
+# Synthetic inputs
+#
+
+def make_sparse_index(fname, vsize, density, seed = 1):
+    '''Sparse index of virtual size vsize, with about density of the 512 byte blocks present
+    Returns the number of bytes actually written'''
+    rnd = random.Random(seed)
+    blocks = vsize // 512
+    clusters = max(1, int(blocks * density) // CLUSTER)
+    starts = sorted(set(rnd.randrange(0, max(1, blocks - CLUSTER)) for _ in range(clusters)))
+    content = bytes(rnd.getrandbits(8) | 1 for _ in range(512 * CLUSTER))
+    written = 0
+    last_end = 0
+    with open(fname, 'wb') as f:
+        for start in starts:
+            start = max(start, last_end)
+            if start + CLUSTER > blocks:
+                break
+            os.pwrite(f.fileno(), content, start * 512)
+            written += len(content)
+            last_end = start + CLUSTER
+        f.truncate(vsize)
+    return written
+
+def make_mrf(basename, jpegs, ntiles):
+    '''MRF data and index files, ntiles tiles cycling through the jpegs'''
+    with open(basename + '.pjg', 'wb') as data, open(basename + '.idx', 'wb') as idx:
+        offset = 0
+        for i in range(ntiles):
+            tile = jpegs[i % len(jpegs)]
+            data.write(tile)
+            idx.write(struct.pack('>QQ', offset, len(tile)))
+            offset += len(tile)
+    return offset
+
+def make_bundle(fname, jpegs, ntiles):
+    '''esri V2 bundle, 128x128 tiles, each tile prefixed by its size'''
+    bsz = 128 * 128
+    ntiles = min(ntiles, bsz)
+    hdrsz = 64
+    index = bytearray(bsz * 8)
+    data = bytearray()
+    offset = hdrsz + len(index)
+    for i in range(ntiles):
+        tile = jpegs[i % len(jpegs)]
+        data += struct.pack('<I', len(tile))
+        struct.pack_into('<Q', index, 8 * i, (offset + len(data)) | (len(tile) << 40))
+        data += tile
+    header = bytearray(hdrsz)
+    struct.pack_into('<I', header, 0, 3)
+    struct.pack_into('<Q', header, 24, offset + len(data))
+    with open(fname, 'wb') as f:
+        f.write(header + index + data)
+    return len(data) - 4 * ntiles
+
+#
+# Measurement
+#
+
+def run(cmd):
+    '''Runs a command, returns wall time in seconds and peak RSS in KB'''
+    with tempfile.TemporaryFile() as errfile:
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd, stdout = subprocess.DEVNULL, stderr = errfile)
+        # wait4 returns the resource usage of this child only
+        _, status, usage = os.wait4(proc.pid, 0)
+        seconds = time.perf_counter() - start
+        proc.returncode = status # Already reaped
+        if not os.WIFEXITED(status) or os.WEXITSTATUS(status) != 0:
+            errfile.seek(0)
+            raise RuntimeError("{} failed: {}".format(' '.join(cmd),
+                errfile.read().decode(errors = 'replace').strip()))
+    return seconds, usage.ru_maxrss
+
+def git_commit():
+    try:
+        return subprocess.check_output(['git', 'rev-parse', '--short', 'HEAD'],
+            cwd = os.path.dirname(os.path.abspath(__file__)), stderr = subprocess.DEVNULL).decode().strip()
+    except Exception:
+        return None
+
+class Recorder:
+    def __init__(self, fname, repeat):
+        self.fname = fname
+        self.repeat = repeat
+        self.common = {
+            'time' : time.strftime('%Y-%m-%dT%H:%M:%S'),
+            'host' : socket.gethostname(),
+            'commit' : git_commit(),
+            'cpus' : os.cpu_count()
+        }
+
+    def measure(self, bench, cmd, params, bytes_in = None, tiles = None):
+        '''Best of repeat runs'''
+        seconds, rss = min(run(cmd) for _ in range(self.repeat))
+        result = dict(self.common)
+        result.update({'bench' : bench, 'params' : params,
+            'seconds' : round(seconds, 4), 'peak_rss_kb' : rss})
+        seconds = max(seconds, 1e-9)
+        if bytes_in is not None:
+            result['bytes'] = bytes_in
+            result['mb_per_s'] = round(bytes_in / MB / seconds, 2)
+        if tiles is not None:
+            result['tiles'] = tiles
+            result['tiles_per_s'] = round(tiles / seconds, 1)
+        if self.fname:
+            with open(self.fname, 'a') as f:
+                f.write(json.dumps(result) + '\n')
+        line = "{:8} {:40} {:9.3f}s".format(bench, json.dumps(params), result['seconds'])
+        if 'mb_per_s' in result:
+            line += " {:10.1f} MB/s".format(result['mb_per_s'])
+        if 'tiles_per_s' in result:
+            line += " {:10.0f} tiles/s".format(result['tiles_per_s'])
+        print(line + " {:8d} KB".format(rss))
+        sys.stdout.flush()
+        return result
+
+def bench_can(rec, bindir, work, max_data):
+    can = os.path.join(bindir, 'can')
+    if not os.path.isfile(can):
+        print("Skipping can, {} not found".format(can))
+        return
+    for vsize in INDEX_SIZES:
+        for density in DENSITIES:
+            if vsize * density > max_data:
+                continue
+            idxname = os.path.join(work, 'bench.idx')
+            ixname = os.path.join(work, 'bench.ix')
+            outname = os.path.join(work, 'bench_out.idx')
+            written = make_sparse_index(idxname, vsize, density)
+            params = {'virtual_size' : vsize, 'density' : density, 'data_bytes' : written}
+            # Throughput is relative to the virtual size, which is what can has to cover
+            rec.measure('can', [can, idxname, ixname], params, bytes_in = vsize)
+            rec.measure('uncan', [can, '-u', ixname, outname], params, bytes_in = vsize)
+            for f in (idxname, ixname, outname):
+                os.remove(f)
+
+def bench_jxl(rec, bindir, work, ntiles, threads):
+    jxl = os.path.join(bindir, 'jxl')
+    if not os.path.isfile(jxl):
+        print("Skipping jxl, {} not found".format(jxl))
+        return
+    jpegs = make_jpegs(8, 256)
+    base = os.path.join(work, 'tiles')
+    size = make_mrf(base, jpegs, ntiles)
+    bundle = os.path.join(work, 'tiles.bundle')
+    bsize = make_bundle(bundle, jpegs, ntiles)
+    btiles = min(ntiles, 128 * 128)
+    for t in sorted(set(threads)):
+        params = {'tiles' : ntiles, 'threads' : t}
+        rec.measure('mrf_to_jxl', [jxl, '-j', str(t), base + '.pjg'], params,
+            bytes_in = size, tiles = ntiles)
+        rec.measure('jxl_to_mrf', [jxl, '-r', '-j', str(t), base + '.pjg.jxl'], params,
+            bytes_in = os.path.getsize(base + '.pjg.jxl'), tiles = ntiles)
+        params = {'tiles' : btiles, 'threads' : t}
+        rec.measure('bundle_to_jxl', [jxl, '-b', '-j', str(t), bundle], params,
+            bytes_in = bsize, tiles = btiles)
+
+def main():
+    parser = argparse.ArgumentParser(description = __doc__,
+        formatter_class = argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-o", "--output", default = "bench_results.jsonl",
+        help = "JSON lines file the results are appended to, empty to only print them")
+    parser.add_argument("-b", "--bindir", default = os.path.dirname(os.path.abspath(__file__)),
+        help = "Location of the tools, defaults to the script location")
+    parser.add_argument("-w", "--workdir",
+        help = "Location for the synthetic inputs, needs a file system with sparse files")
+    parser.add_argument("-m", "--max-data", type = int, default = 256,
+        help = "Maximum data written in a synthetic index, in MB, skips larger cases")
+    parser.add_argument("-t", "--tiles", type = int, default = 4096,
+        help = "Number of JPEG tiles")
+    parser.add_argument("-r", "--repeat", type = int, default = 1,
+        help = "Runs of each case, the best time is reported")
+    parser.add_argument("-q", "--quick", action = "store_true",
+        help = "Small cases only, for a quick check")
+    args = parser.parse_args()
+
+    global INDEX_SIZES
+    max_data = args.max_data * MB
+    ntiles = args.tiles
+    if args.quick:
+        INDEX_SIZES = INDEX_SIZES[:1]
+        ntiles = min(ntiles, 512)
+    work = tempfile.mkdtemp(prefix = 'mrf_bench', dir = args.workdir)
+    rec = Recorder(args.output, max(1, args.repeat))
+    try:
+        bench_can(rec, args.bindir, work, max_data)
+        bench_jxl(rec, args.bindir, work, ntiles, (1, os.cpu_count() or 1))
+    finally:
+        shutil.rmtree(work, ignore_errors = True)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,331 @@
+/*
+ * file: mrf_clean.cpp
+ *
+ * Copies the active tile data and index files of an MRF, ignoring the unused parts
+ * of the data file. Same arguments as mrf_clean.py
+ *
+ * mrf_clean [-j N] [-q] <source> <destination> [empty_file]
+ *
+ * The source and destination are the data file names, the index file names are
+ * the same with the .idx extension. The optional empty_file content is copied
+ * at the start of the destination data file.
+ *
+ * The tiles are read in source data file order, so the source is read front to back.
+ * Tiles that are adjacent in the source are copied in one operation, using
+ * copy_file_range when available, which lets the kernel or the file system do the copy.
+ * Index entries that point to the same tile keep sharing it in the output.
+ * With -d, tiles with identical content are also stored only once. Each tile is read,
+ * hashed and compared with the previous tiles that have the same hash and size.
+ * The output index has the same size as the input one and it is sparse,
+ * only the 512 byte blocks holding tile entries are written.
+ *
+ */
+
+#include "mrf_index.h"
+#include "tile_dedup.h"
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <thread>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+const static int BUFSZ(1024 * 1024); // Copy and index read buffer
+const static uint64_t RUNSZ(16 * 1024 * 1024); // Maximum copied at once, balances the threads
+
+int Usage(const string &s) {
+    cerr << s << endl << endl
+    << "Synopsis: mrf_clean [OPTIONS] <source> <destination> [empty_file]\n"
+    << "\tsource and destination are MRF data file names, the index file has the .idx extension\n"
+    << "\tThe empty_file content is written at the start of the destination data file\n"
+    << "\t-j N\tCopy on N threads, 0 for all cores, default is 1\n"
+    << "\t-d\tDeduplicate, store identical tiles only once, single threaded\n"
+    << "\t-q\tQuiet, don't print the summary\n";
+    return 1;
+}
+
+// Index file name for an MRF data file
+static string index_name(const string &name) {
+    auto dot = name.find_last_of('.');
+    auto slash = name.find_last_of("/\\");
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+        return name + ".idx";
+    return name.substr(0, dot) + ".idx";
+}
+
+// Contiguous bytes to be copied from source to destination
+struct copy_run {
+    uint64_t src;
+    uint64_t dst;
+    uint64_t size;
+};
+
+// Copy the tiles in order, storing the identical ones only once
+// Tiles are written starting at doffset, which is updated, as are the tile offsets
+static string copy_dedup(int fdin, int fdout, vector<ranked_index<tinfo>> &tiles,
+    uint64_t &doffset, uint64_t &ntiles, uint64_t &nshared)
+{
+    dedup_table table;
+    vector<char> tile, other, out;
+    out.reserve(BUFSZ);
+    uint64_t out_offset = doffset; // Where out goes
+    tinfo last = {0, 0};
+    uint64_t last_dst = 0;
+    for (auto &t : tiles) {
+        if (!t.idx.size)
+            continue;
+        size_t size = static_cast<size_t>(t.idx.size);
+        // Same tile as the previous entry, no need to read it
+        if (last.size && last.offset == t.idx.offset && last.size == t.idx.size) {
+            t.idx.offset = last_dst;
+            continue;
+        }
+        last = t.idx;
+        tile.resize(size);
+        if (!pread_all(fdin, tile.data(), size, t.idx.offset))
+            return "Error reading tile data";
+        // Compare with the source copy of the candidate
+        auto same = [&](uint64_t location) {
+            other.resize(size);
+            return pread_all(fdin, other.data(), size, location)
+                && 0 == memcmp(tile.data(), other.data(), size);
+        };
+        uint64_t hash = hash64(tile.data(), size);
+        if (table.find(hash, size, same, last_dst)) {
+            nshared++;
+        }
+        else {
+            table.insert(hash, size, t.idx.offset, doffset);
+            if (out.size() + size > BUFSZ) {
+                if (!pwrite_all(fdout, out.data(), out.size(), out_offset))
+                    return "Error writing destination data file";
+                out_offset += out.size();
+                out.clear();
+            }
+            if (size > BUFSZ) { // Big tile, write it directly
+                if (!pwrite_all(fdout, tile.data(), size, out_offset))
+                    return "Error writing destination data file";
+                out_offset += size;
+            }
+            else {
+                out.insert(out.end(), tile.begin(), tile.end());
+            }
+            last_dst = doffset;
+            doffset += size;
+            ntiles++;
+        }
+        t.idx.offset = last_dst;
+    }
+    if (!pwrite_all(fdout, out.data(), out.size(), out_offset))
+        return "Error writing destination data file";
+    return string();
+}
+
+int main(int argc, char **argv) {
+    int threads = 1;
+    bool quiet = false;
+    bool dedup = false;
+    vector<string> names;
+    for (int i = 1; i < argc; i++) {
+        string arg(argv[i]);
+        if (arg == "-j" && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 0)
+                return Usage("Invalid number of threads");
+            if (0 == threads)
+                threads = max(1u, thread::hardware_concurrency());
+        }
+        else if (arg == "-q")
+            quiet = true;
+        else if (arg == "-d")
+            dedup = true;
+        else if (arg.size() > 1 && arg[0] == '-')
+            return Usage("Unknown option " + arg);
+        else
+            names.push_back(arg);
+    }
+    if (names.size() < 2 || names.size() > 3)
+        return Usage("Needs a source and a destination");
+    const string &source = names[0];
+    const string &destination = names[1];
+    if (index_name(source) == index_name(destination))
+        return Usage("Source and destination have to be different");
+
+    FILE *finidx = fopen(index_name(source).c_str(), "rb");
+    if (!finidx)
+        return Usage("Can't open source index " + index_name(source));
+    FSEEK(finidx, 0, SEEK_END);
+    uint64_t isize = FTELL(finidx);
+    if (isize % sizeof(tinfo)) {
+        fclose(finidx);
+        return Usage("Source index size is not a multiple of 16");
+    }
+
+    int fdin = open(source.c_str(), O_RDONLY);
+    struct stat statb;
+    if (fdin < 0 || fstat(fdin, &statb)) {
+        fclose(finidx);
+        return Usage("Can't open source data file " + source);
+    }
+    uint64_t dsize = statb.st_size;
+
+    // Read the index entries that are not zero, skipping the holes
+    vector<ranked_index<tinfo>> tiles;
+    vector<tinfo> chunk(BUFSZ / sizeof(tinfo));
+    string err;
+    for (auto &range : allocated_ranges(finidx, isize)) {
+        uint64_t pos = range.start / sizeof(tinfo);
+        uint64_t end = (range.end + sizeof(tinfo) - 1) / sizeof(tinfo);
+        FSEEK(finidx, pos * sizeof(tinfo), SEEK_SET);
+        while (pos < end) {
+            size_t n = static_cast<size_t>(min<uint64_t>(chunk.size(), end - pos));
+            if (n != fread(chunk.data(), sizeof(tinfo), n, finidx)) {
+                err = "Error reading source index";
+                break;
+            }
+            for (size_t i = 0; i < n; i++, pos++) {
+                if (!chunk[i].offset && !chunk[i].size)
+                    continue;
+                chunk[i].toh();
+                tiles.emplace_back(chunk[i], pos);
+            }
+        }
+        if (!err.empty())
+            break;
+    }
+    fclose(finidx);
+    if (!err.empty()) {
+        close(fdin);
+        return Usage(err);
+    }
+
+    // Source data file order
+    sort(tiles.begin(), tiles.end());
+
+    // Tiles are checked before the destination is touched
+    for (auto &t : tiles) {
+        if (t.idx.size && (t.idx.offset + t.idx.size > dsize || t.idx.offset + t.idx.size < t.idx.offset)) {
+            close(fdin);
+            return Usage("Corrupt index, tile outside of the source data file");
+        }
+    }
+
+    // Start with the empty tile content, if any
+    uint64_t prefix = 0;
+    vector<char> buffer(BUFSZ);
+    int fdout = open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fdout < 0) {
+        close(fdin);
+        return Usage("Can't open destination data file " + destination);
+    }
+    if (names.size() == 3) {
+        int fde = open(names[2].c_str(), O_RDONLY);
+        if (fde < 0 || fstat(fde, &statb) || !copy_rw(fde, fdout, 0, 0, statb.st_size, buffer))
+            err = "Can't copy empty file " + names[2];
+        else
+            prefix = statb.st_size;
+        if (fde >= 0)
+            close(fde);
+    }
+
+    // Assign the output offsets, in source order, and merge the adjacent tiles in runs
+    vector<copy_run> runs;
+    uint64_t doffset = prefix;
+    uint64_t ntiles = 0; // Tiles copied
+    uint64_t nshared = 0; // Tiles identical to a previous one
+    if (err.empty() && dedup) {
+        err = copy_dedup(fdin, fdout, tiles, doffset, ntiles, nshared);
+    }
+    else if (err.empty()) {
+        tinfo last = {0, 0}; // Last tile copied, source location
+        uint64_t last_dst = 0;
+        for (auto &t : tiles) {
+            if (!t.idx.size)
+                continue; // Not a tile, keep the entry as is
+            // Same tile as the previous entry, share it
+            if (last.size && last.offset == t.idx.offset && last.size == t.idx.size) {
+                t.idx.offset = last_dst;
+                continue;
+            }
+            last = t.idx;
+            if (!runs.empty() && runs.back().src + runs.back().size == t.idx.offset
+                && runs.back().size + t.idx.size <= RUNSZ)
+                runs.back().size += t.idx.size;
+            else
+                runs.push_back({t.idx.offset, doffset, t.idx.size});
+            t.idx.offset = last_dst = doffset;
+            doffset += t.idx.size;
+            ntiles++;
+        }
+    }
+
+    // Copy the runs
+    if (err.empty()) {
+        atomic<size_t> next(0);
+        atomic<bool> failed(false);
+        auto worker = [&](vector<char> &buf) {
+            for (size_t i = next++; i < runs.size() && !failed; i = next++)
+                if (!copy_data(fdin, fdout, runs[i].src, runs[i].dst, runs[i].size, buf))
+                    failed = true;
+        };
+        threads = static_cast<int>(min<size_t>(threads, max<size_t>(1, runs.size())));
+        vector<vector<char>> buffers(threads - 1, vector<char>(BUFSZ));
+        vector<thread> pool;
+        for (auto &b : buffers)
+            pool.emplace_back(worker, ref(b));
+        worker(buffer);
+        for (auto &th : pool)
+            th.join();
+        if (failed)
+            err = "Error copying tile data";
+    }
+    close(fdin);
+    if (err.empty() && ftruncate(fdout, doffset))
+        err = "Error writing destination data file";
+    if (close(fdout) && err.empty())
+        err = "Error writing destination data file";
+    if (!err.empty())
+        return Usage(err);
+
+    // Write the index in tile order, leaving holes
+    FILE *foutidx = fopen(index_name(destination).c_str(), "wb");
+    if (!foutidx)
+        return Usage("Can't open destination index " + index_name(destination));
+    SETSPARSE(foutidx);
+    sort(tiles.begin(), tiles.end(), ranked_index<tinfo>::by_rank);
+    uint64_t oidx = 0;
+    for (auto &t : tiles) {
+        if (oidx != t.rank)
+            FSEEK(foutidx, t.rank * sizeof(tinfo), SEEK_SET);
+        t.idx.ton();
+        oidx = t.rank + 1;
+        if (!fwrite(&t.idx, sizeof(tinfo), 1, foutidx)) {
+            err = "Error writing destination index";
+            break;
+        }
+    }
+    // Output index has the same size as the input one
+    FSEEK(foutidx, isize, SEEK_SET);
+    if (err.empty() && !MARK_END(foutidx))
+        err = "Error writing destination index";
+    if (fclose(foutidx) && err.empty())
+        err = "Error writing destination index";
+    if (!err.empty())
+        return Usage(err);
+
+    if (!quiet)
+        cerr << "Copied " << ntiles << " tiles, " << doffset - prefix << " bytes, source data file was "
+            << dsize << " bytes, saved " << (dsize ? (1 - double(doffset) / dsize) * 100 : 0) << "%\n";
+    if (!quiet && dedup)
+        cerr << "Found " << nshared << " duplicate tiles\n";
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * file: mrf_index.h
+ *
+ * MRF index structures and file helpers, shared by the MRF tools
+ *
+ * The MRF index is a sequence of 16 byte entries, the offset and the size of a tile
+ * within the data file, as 64 bit big endian integers. A zero size means the tile is
+ * not present. The index file is usually sparse, large regions of it are never written
+ *
+ */
+
+#if !defined(MRF_INDEX_H)
+#define MRF_INDEX_H
+
+#if defined(_WIN32)
+#include <Windows.h>
+#include <io.h>
+
+#define FSEEK _fseeki64
+#define FTELL _ftelli64
+
+ // Windows is always little endian, supply functions to swap bytes
+ // These are defined in <cstdlib>
+#if !defined(be64toh)
+#define htobe16 _byteswap_ushort
+#define be16toh _byteswap_ushort
+#define htobe32 _byteswap_ulong
+#define be32toh _byteswap_ulong
+#define htobe64 _byteswap_uint64
+#define be64toh _byteswap_uint64
+#endif
+
+#else
+#include <unistd.h>
+#include <endian.h>
+#define FSEEK fseeko
+#define FTELL ftello
+#endif
+
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+// Big Endian native
+struct tinfo {
+    uint64_t offset;
+    uint64_t size;
+    void toh() {
+        offset = be64toh(offset);
+        size = be64toh(size);
+    }
+    void ton() {
+        offset = htobe64(offset);
+        size = htobe64(size);
+    }
+    bool operator<(const tinfo &other) const {
+        return offset < other.offset;
+    }
+};
+
+static_assert(sizeof(tinfo) == 16, "MRF index entries are 16 bytes");
+
+// It's really a pair, so we can sort by offset or by rank
+// Ties in offset are broken by rank, so the order is deterministic
+template<typename T> struct ranked_index {
+    ranked_index(T idx, uint64_t rank) : idx (idx), rank(rank) {}
+    T idx;
+    uint64_t rank;
+    bool operator<(const ranked_index &other) const {
+        return idx < other.idx || (!(other.idx < idx) && rank < other.rank);
+    }
+    static bool by_rank(const ranked_index &a, const ranked_index &b) {
+        return a.rank < b.rank;
+    }
+};
+
+// Make file end at current offset, return true on success
+static inline bool MARK_END(FILE *f) {
+#if defined(_WIN32)
+    HANDLE h = (HANDLE) _get_osfhandle(_fileno(f));
+    if (h == INVALID_HANDLE_VALUE)
+        return false; // Possibly not a seekable file
+    return 0 != SetEndOfFile(h);
+#else
+    fflush(f);
+    return !ftruncate(fileno(f), FTELL(f));
+#endif
+}
+
+// Set file as sparse, returns true if all went fine
+// Files are sparse by default on POSIX
+static inline bool SETSPARSE(FILE *f) {
+#if defined(_WIN32)
+    DWORD dw;
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(f));
+    if (INVALID_HANDLE_VALUE == h)
+        return false;
+    return 0 != DeviceIoControl(h, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &dw, nullptr);
+#else
+    (void)f;
+    return true;
+#endif
+}
+
+// Byte range of a file, [start, end)
+struct byte_range {
+    uint64_t start;
+    uint64_t end;
+};
+
+// Allocated ranges of a file, in order. Holes in a sparse file read as zeros
+// If the file system can't tell, the whole file is one range
+static inline std::vector<byte_range> allocated_ranges(FILE *f, uint64_t size) {
+    std::vector<byte_range> ranges;
+#if defined(_WIN32)
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(f));
+    FILE_ALLOCATED_RANGE_BUFFER query, out[512];
+    query.FileOffset.QuadPart = 0;
+    query.Length.QuadPart = size;
+    for (;;) {
+        DWORD bytes = 0;
+        BOOL ok = (INVALID_HANDLE_VALUE != h) && DeviceIoControl(h, FSCTL_QUERY_ALLOCATED_RANGES,
+            &query, sizeof(query), out, sizeof(out), &bytes, nullptr);
+        if (!ok && GetLastError() != ERROR_MORE_DATA) {
+            ranges.clear();
+            break;
+        }
+        size_t n = bytes / sizeof(out[0]);
+        for (size_t i = 0; i < n; i++)
+            ranges.push_back({static_cast<uint64_t>(out[i].FileOffset.QuadPart),
+                static_cast<uint64_t>(out[i].FileOffset.QuadPart + out[i].Length.QuadPart)});
+        if (ok || n == 0)
+            return ranges;
+        // More to come, continue after the last one
+        query.FileOffset.QuadPart = ranges.back().end;
+        query.Length.QuadPart = size - ranges.back().end;
+    }
+#elif defined(SEEK_DATA) && defined(SEEK_HOLE)
+    int fd = fileno(f);
+    uint64_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(fd, pos, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO)
+                return ranges; // Only a hole left
+            ranges.clear(); // Not supported
+            break;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0) {
+            ranges.clear();
+            break;
+        }
+        ranges.push_back({static_cast<uint64_t>(data), std::min(static_cast<uint64_t>(hole), size)});
+        pos = hole;
+    }
+    if (!ranges.empty() || size == 0)
+        return ranges;
+#endif
+    ranges.push_back({0, size});
+    return ranges;
+}
+
+#if !defined(_WIN32)
+// POSIX file descriptor copy helpers
+
+// Read len bytes at offset, false on error or end of file
+static inline bool pread_all(int fd, char *buffer, size_t len, uint64_t offset) {
+    while (len) {
+        ssize_t got = pread(fd, buffer, len, offset);
+        if (got <= 0)
+            return false;
+        buffer += got;
+        offset += got;
+        len -= got;
+    }
+    return true;
+}
+
+// Write len bytes at offset
+static inline bool pwrite_all(int fd, const char *buffer, size_t len, uint64_t offset) {
+    while (len) {
+        ssize_t w = pwrite(fd, buffer, len, offset);
+        if (w <= 0)
+            return false;
+        buffer += w;
+        offset += w;
+        len -= w;
+    }
+    return true;
+}
+
+// Read and write size bytes at the given offsets, using buffer
+static inline bool copy_rw(int fdin, int fdout, uint64_t src, uint64_t dst, uint64_t size,
+    std::vector<char> &buffer)
+{
+    while (size) {
+        size_t len = static_cast<size_t>(std::min<uint64_t>(size, buffer.size()));
+        if (!pread_all(fdin, buffer.data(), len, src) || !pwrite_all(fdout, buffer.data(), len, dst))
+            return false;
+        src += len;
+        dst += len;
+        size -= len;
+    }
+    return true;
+}
+
+// Set once copy_file_range turns out to be unusable
+static inline std::atomic<bool> &no_copy_range() {
+    static std::atomic<bool> flag(false);
+    return flag;
+}
+
+// Copy size bytes at the given offsets, in kernel when possible, thread safe
+static inline bool copy_data(int fdin, int fdout, uint64_t src, uint64_t dst, uint64_t size,
+    std::vector<char> &buffer)
+{
+    uint64_t done = 0;
+#if defined(__linux__)
+    while (!no_copy_range() && done < size) {
+        loff_t in_off = src + done;
+        loff_t out_off = dst + done;
+        ssize_t n = copy_file_range(fdin, &in_off, fdout, &out_off, size - done, 0);
+        if (n > 0) {
+            done += n;
+            continue;
+        }
+        if (n == 0)
+            return false; // Source is shorter than expected
+        if (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)
+            no_copy_range() = true; // Copy through user space from now on
+        else
+            return false;
+    }
+#endif
+    return copy_rw(fdin, fdout, src + done, dst + done, size - done, buffer);
+}
+#endif
+
+#endif
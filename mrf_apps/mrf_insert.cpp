@@ -37,6 +37,16 @@
 
 #include "mrf_insert.h"
 
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <limits>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
+#include <sstream>
+
 using namespace std;
 USING_NAMESPACE_MRF
 
@@ -67,21 +77,123 @@ static bool outside_bounds(const Bounds &inside, const Bounds &outside, XY toler
         inside.uy - tolerance.y > outside.uy);
 }
 
+// Tile location within a level as a single value, sorts by row then column
+static inline GUIntBig tile_key(int x, int y)
+{
+    return (static_cast<GUIntBig>(y) << 32) | static_cast<unsigned int>(x);
+}
+
+static inline int tile_x(GUIntBig key) { return static_cast<int>(key & 0xffffffff); }
+
+static inline int tile_y(GUIntBig key) { return static_cast<int>(key >> 32); }
+
+static GIntBig wall_ns()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// CPU time of the calling thread, zero if not available
+static GIntBig thread_cpu_ns()
+{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    timespec ts;
+    if (0 == clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return static_cast<GIntBig>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+    return 0;
+}
+
+// CPU time of the process, all threads
+static GIntBig process_cpu_ns()
+{
+    return static_cast<GIntBig>(clock()) * (1000000000 / CLOCKS_PER_SEC);
+}
+
+// Adds the time spent in a scope to a phase, does nothing if the phase is NULL
+class phase_timer {
+public:
+    explicit phase_timer(phase_time *phase) : phase(phase), wall(0), cpu(0)
+    {
+        if (phase != NULL)
+        {
+            wall = wall_ns();
+            cpu = thread_cpu_ns();
+        }
+    }
+
+    ~phase_timer()
+    {
+        if (phase == NULL)
+            return;
+        phase->wall += wall_ns() - wall;
+        phase->cpu += thread_cpu_ns() - cpu;
+        phase->count++;
+    }
+
+private:
+    phase_time *phase;
+    GIntBig wall, cpu;
+};
+
+// Sizes of the target index and of the other files, except the metadata
+static void target_sizes(GDALDataset *pTDS, GIntBig &index, GIntBig &data)
+{
+    index = data = 0;
+    char **papszFiles = pTDS->GetFileList();
+    for (int i = 0; papszFiles != NULL && papszFiles[i] != NULL; i++)
+    {
+        VSIStatBufL sStat;
+        if (0 != VSIStatL(papszFiles[i], &sStat))
+            continue;
+        if (EQUAL(CPLGetExtension(papszFiles[i]), "idx"))
+            index += sStat.st_size;
+        else if (i != 0) // The first one is the .mrf
+            data += sStat.st_size;
+    }
+    CSLDestroy(papszFiles);
+}
+
+// Start the totals, they hold the negative starting values until stats_end
+static void stats_begin(GDALDataset *pTDS, run_stats *stats)
+{
+    if (stats == NULL)
+        return;
+    stats->total.wall = -wall_ns();
+    stats->total.cpu = -process_cpu_ns();
+    target_sizes(pTDS, stats->index_added, stats->data_added);
+    stats->index_added = -stats->index_added;
+    stats->data_added = -stats->data_added;
+}
+
+// Flush the target, then complete the totals
+static void stats_flush(GDALDataset *pTDS, run_stats *stats)
+{
+    if (stats != NULL)
+        stats->cache_used = GDALGetCacheUsed64();
+    {
+        phase_timer timer(stats ? &stats->flush : NULL);
+        pTDS->FlushCache();
+    }
+    if (stats == NULL)
+        return;
+    stats->total.wall += wall_ns();
+    stats->total.cpu += process_cpu_ns();
+    GIntBig index, data;
+    target_sizes(pTDS, index, data);
+    stats->index_added += index;
+    stats->data_added += data;
+}
+
 //
-// Works like RasterIO, except that it trims the request as needed for the input image
-// Only works with read currently
+// Trims a window to a raster of the given size, adjusting the buffer pointer to match
 //
-CPLErr ClippedRasterIO(GDALRasterBand *band, GDALRWFlag eRWFlag,
-                       int nXOff, int nYOff,
-                       int nXSize, int nYSize,
-                       void *pData,
-                       GDALDataType eBufType,
-                       int nPixelSpace,
-                       int nLineSpace)
+static void ClipWindow(int nRXSize, int nRYSize,
+                       int &nXOff, int &nYOff,
+                       int &nXSize, int &nYSize,
+                       char *&pcData,
+                       GSpacing nPixelSpace,
+                       GSpacing nLineSpace)
 {
-    CPLAssert(GF_Read == eRWFlag);
-    auto pcData = reinterpret_cast<char *>(pData);
-
     if (nXOff < 0)
     {
         // Adjust the start of the line
@@ -90,10 +202,10 @@ CPLErr ClippedRasterIO(GDALRasterBand *band, GDALRWFlag eRWFlag,
         nXSize += nXOff; // XOff is negative, so this is a subtraction
         nXOff = 0;
     }
-    if (nXOff + nXSize > band->GetXSize())
+    if (nXOff + nXSize > nRXSize)
     {
         // Clip end of lines
-        nXSize = band->GetXSize() - nXOff;
+        nXSize = nRXSize - nXOff;
     }
 
     if (nYOff < 0)
@@ -104,19 +216,135 @@ CPLErr ClippedRasterIO(GDALRasterBand *band, GDALRWFlag eRWFlag,
         nYSize += nYOff; // YOff is negative, so this is a subtraction
         nYOff = 0;
     }
-    if (nYOff + nYSize > band->GetYSize())
+    if (nYOff + nYSize > nRYSize)
     {
         // Clip end of columns
-        nYSize = band->GetYSize() - nYOff;
+        nYSize = nRYSize - nYOff;
     }
+}
+
+//
+// Works like RasterIO, except that it trims the request as needed for the input image
+// Only works with read currently
+//
+CPLErr ClippedRasterIO(GDALRasterBand *band, GDALRWFlag eRWFlag,
+                       int nXOff, int nYOff,
+                       int nXSize, int nYSize,
+                       void *pData,
+                       GDALDataType eBufType,
+                       int nPixelSpace,
+                       int nLineSpace)
+{
+    CPLAssert(GF_Read == eRWFlag);
+    auto pcData = reinterpret_cast<char *>(pData);
+    ClipWindow(band->GetXSize(), band->GetYSize(), nXOff, nYOff, nXSize, nYSize,
+               pcData, nPixelSpace, nLineSpace);
 
     // Call the raster band read with the trimmed values
     return band->RasterIO(GF_Read, nXOff, nYOff, nXSize, nYSize,
                           pcData, nXSize, nYSize, eBufType, nPixelSpace, nLineSpace, NULL);
 }
 
-// Insert the target in the base level
+//
+// Same, for the first nBandCount bands of a dataset, in a single call
+//
+CPLErr ClippedRasterIO(GDALDataset *ds, GDALRWFlag eRWFlag,
+                       int nXOff, int nYOff,
+                       int nXSize, int nYSize,
+                       void *pData,
+                       GDALDataType eBufType,
+                       int nBandCount,
+                       GSpacing nPixelSpace,
+                       GSpacing nLineSpace,
+                       GSpacing nBandSpace)
+{
+    CPLAssert(GF_Read == eRWFlag);
+    auto pcData = reinterpret_cast<char *>(pData);
+    ClipWindow(ds->GetRasterXSize(), ds->GetRasterYSize(), nXOff, nYOff, nXSize, nYSize,
+               pcData, nPixelSpace, nLineSpace);
+
+    return ds->RasterIO(GF_Read, nXOff, nYOff, nXSize, nYSize,
+                        pcData, nXSize, nYSize, eBufType, nBandCount, NULL,
+                        nPixelSpace, nLineSpace, nBandSpace, NULL);
+}
+
+// Equality which also matches NaN with NaN, for NoData
+template<typename T> static inline bool same_value(T a, T b)
+{
+    return a == b || (a != a && b != b);
+}
+
+//
+// Reduces 2x2 tiles to one tile, the source line is twice the tile width
+// Only the first xsz by ysz source pixels are valid
+// Average excludes the NoData values, Nearest picks the first valid value of every 2x2 group
+//
+template<typename T>
+static void Decimate(const T *src, int xsz, int ysz, T *dst, int tsz_x, int tsz_y,
+                     bool average, int has_ndv, double ndv)
+{
+    const T nodata = static_cast<T>(has_ndv ? ndv : 0);
+    for (int y = 0; y < tsz_y; y++)
+    {
+        for (int x = 0; x < tsz_x; x++)
+        {
+            double sum = 0;
+            int count = 0;
+            T value = nodata;
+            for (int sy = 2 * y; sy < min(2 * y + 2, ysz); sy++)
+            {
+                for (int sx = 2 * x; sx < min(2 * x + 2, xsz); sx++)
+                {
+                    T v = src[sy * 2 * tsz_x + sx];
+                    if (has_ndv && same_value(v, nodata))
+                        continue;
+                    if (count++ == 0)
+                        value = v;
+                    sum += v;
+                }
+            }
+            if (average && count > 1)
+            {
+                sum /= count;
+                // Round integer types
+                value = static_cast<T>(numeric_limits<T>::is_integer ? floor(sum + 0.5) : sum);
+            }
+            dst[y * tsz_x + x] = value;
+        }
+    }
+}
+
+// Decimate for a GDAL data type, returns false if the type is not supported
+static bool Decimate(GDALDataType eDataType, const void *src, int xsz, int ysz, void *dst,
+                     int tsz_x, int tsz_y, bool average, int has_ndv, double ndv)
+{
+#define DECIMATE(T) Decimate(reinterpret_cast<const T *>(src), xsz, ysz, reinterpret_cast<T *>(dst), \
+                             tsz_x, tsz_y, average, has_ndv, ndv)
+    switch (eDataType)
+    {
+    case GDT_Byte: DECIMATE(GByte); break;
+    case GDT_UInt16: DECIMATE(GUInt16); break;
+    case GDT_Int16: DECIMATE(GInt16); break;
+    case GDT_UInt32: DECIMATE(GUInt32); break;
+    case GDT_Int32: DECIMATE(GInt32); break;
+    case GDT_Float32: DECIMATE(float); break;
+    case GDT_Float64: DECIMATE(double); break;
+    default:
+        return false;
+    }
+#undef DECIMATE
+    return true;
+}
+
+// Insert the source in the target
 bool state::patch()
+{
+    return patch(vector<string>(1, SourceName));
+}
+
+// Insert all the sources in the target, which is opened only once
+// The overviews are updated once, after all the sources are inserted
+bool state::patch(const vector<string> &Sources)
 {
     if (TargetName.empty())
     {
@@ -131,12 +359,6 @@ bool state::patch()
         MRFDataset *pTarg;
     };
 
-    union
-    {
-        GDALDatasetH hPatch;
-        GDALDataset *pSDS;
-    };
-
     CPLPushErrorHandler(CPLQuietErrorHandler);
     hDataset = GDALOpen(TargetName.c_str(), GA_Update);
     CPLPopErrorHandler();
@@ -147,42 +369,88 @@ bool state::patch()
         return false;
     }
 
-    try
+    // GetDescription is the driver name, uppercase
+    if (!EQUAL(pTDS->GetDriver()->GetDescription(), "MRF"))
+    {
+        CPLError(CE_Failure, CPLE_AppDefined, "Target file is not an MRF");
+        GDALClose(hDataset);
+        return false;
+    }
+
+    // The modified level 0 blocks, for all sources
+    vector<GUIntBig> dirty;
+    for (size_t i = 0; i < Sources.size(); i++)
     {
-        // GetDescription is the driver name, uppercase
-        if (!EQUAL(pTDS->GetDriver()->GetDescription(), "MRF"))
+        run_stats stats;
+        run_stats *pStats = StatsName.empty() ? NULL : &stats;
+        stats_begin(pTDS, pStats);
+
+        if (!insert(pTDS, Sources[i], dirty, pStats))
         {
-            CPLError(CE_Failure, CPLE_AppDefined, "Target file is not an MRF");
-            throw 1;
+            GDALClose(hDataset);
+            return false;
         }
 
-        CPLPushErrorHandler(CPLQuietErrorHandler);
-        hPatch = GDALOpen(SourceName.c_str(), GA_ReadOnly);
-        CPLPopErrorHandler();
+        // Flush output, the blocks written so far are found in dirty by the next source
+        stats_flush(pTDS, pStats);
+        if (pStats != NULL)
+            write_stats(Sources[i], stats);
+    }
 
-        if (hPatch == NULL)
+    // Then worry about overviews
+    if (overlays)
+    {
+        run_stats stats;
+        run_stats *pStats = StatsName.empty() ? NULL : &stats;
+        stats_begin(pTDS, pStats);
+
+        if (!overviews(pTarg, dirty, pStats))
         {
-            CPLError(CE_Failure, CPLE_AppDefined, "Can't open file %s", SourceName.c_str());
-            throw 1;
+            GDALClose(hDataset);
+            return false;
         }
+
+        // Now for the upper levels
+        stats_flush(pTDS, pStats);
+        if (pStats != NULL)
+            write_stats(string(), stats);
+    }
+
+    GDALClose(hDataset);
+    return true;
+}
+
+// Insert a source in the base level of the open target, adds the modified blocks to dirty
+bool state::insert(GDALDataset *pTDS, const string &Source, vector<GUIntBig> &dirty, run_stats *stats)
+{
+    union
+    {
+        GDALDatasetH hPatch;
+        GDALDataset *pSDS;
+    };
+
+    {
+        phase_timer timer(stats ? &stats->open : NULL);
+        CPLPushErrorHandler(CPLQuietErrorHandler);
+        hPatch = GDALOpen(Source.c_str(), GA_ReadOnly);
+        CPLPopErrorHandler();
     }
-    catch (int e)
+
+    if (hPatch == NULL)
     {
-        if (e > 0)
-            GDALClose(hDataset);
+        CPLError(CE_Failure, CPLE_AppDefined, "Can't open file %s", Source.c_str());
         return false;
     }
 
     Bounds blocks_bbox;
     Bounds pix_bbox;
-    int overview_count = 0;
-    void *buffer = NULL;
+    VSILFILE *idx_file = NULL;
 
     try
     {
 
         img_info in_img(hPatch);
-        img_info out_img(hDataset);
+        img_info out_img(pTDS);
 
         if (verbose != 0)
         {
@@ -210,13 +478,11 @@ bool state::patch()
             throw 2;
         }
 
-        // tolerance of 1/1000 of the resolution
-        if ((fabs(in_img.res.x - out_img.res.x) * 1000 > fabs(out_img.res.x)) ||
-            (fabs(in_img.res.y - out_img.res.y) * 1000 > fabs(out_img.res.y)))
-        {
-            CPLError(CE_Failure, CPLE_AppDefined, "Source and target resolutions don't match");
-            throw 2;
-        }
+        // tolerance of 1/1000 of the resolution, otherwise the input gets resampled
+        bool resampled = (fabs(in_img.res.x - out_img.res.x) * 1000 > fabs(out_img.res.x)) ||
+                         (fabs(in_img.res.y - out_img.res.y) * 1000 > fabs(out_img.res.y));
+        if (!resampled)
+            factor.x = factor.y = 1; // Within tolerance
 
         // Get the first band from the output MRF, which always exists, use it to
         // collect band count and block size
@@ -226,24 +492,37 @@ bool state::patch()
         b0->GetBlockSize(&tsz_x, &tsz_y);
 
         GDALDataType eDataType = b0->GetRasterDataType();
-        overview_count = b0->GetOverviewCount();
 
         int pixel_size = GDALGetDataTypeSize(eDataType) / 8; // Bytes per pixel per band
         int line_size = tsz_x * pixel_size;                  // A line has this many bytes
         int buffer_size = line_size * tsz_y;                 // A block size in bytes
 
+        // A pixel interleaved MRF holds all the bands in the same tile. Read and write
+        // all the bands of a block in a single call, so every tile gets compressed once
+        const char *interleave = pTDS->GetMetadataItem("INTERLEAVE", "IMAGE_STRUCTURE");
+        bool interleaved = bands > 1 && interleave != NULL && EQUAL(interleave, "PIXEL");
+        if (interleaved)
+            buffer_size *= bands;
+
         //
         // Location in target (output MRF) pixels
-        pix_bbox.lx = int((in_img.bbox.lx - out_img.bbox.lx) / in_img.res.x + 0.5);
-        pix_bbox.ux = int((in_img.bbox.ux - out_img.bbox.lx) / in_img.res.x + 0.5);
+        pix_bbox.lx = int((in_img.bbox.lx - out_img.bbox.lx) / out_img.res.x + 0.5);
+        pix_bbox.ux = int((in_img.bbox.ux - out_img.bbox.lx) / out_img.res.x + 0.5);
         // note that uy < ly
-        pix_bbox.uy = int((in_img.bbox.uy - out_img.bbox.uy) / in_img.res.y + 0.5);
-        pix_bbox.ly = int((in_img.bbox.ly - out_img.bbox.uy) / in_img.res.y + 0.5);
+        pix_bbox.uy = int((in_img.bbox.uy - out_img.bbox.uy) / out_img.res.y + 0.5);
+        pix_bbox.ly = int((in_img.bbox.ly - out_img.bbox.uy) / out_img.res.y + 0.5);
+
+        // When resampling, the input origin in target pixels, not rounded
+        XY origin;
+        origin.x = resampled ? (in_img.bbox.lx - out_img.bbox.lx) / out_img.res.x : pix_bbox.lx;
+        origin.y = resampled ? (in_img.bbox.uy - out_img.bbox.uy) / out_img.res.y : pix_bbox.uy;
 
         if (verbose != 0)
         {
             cerr << "Pixel location " << pix_bbox << endl
                  << "Factor " << factor.x << "," << factor.y << endl;
+            if (resampled)
+                cerr << "Input will be resampled" << endl;
         }
 
         // First blocks to consider
@@ -257,148 +536,764 @@ bool state::patch()
         if (verbose != 0)
         {
             cerr << "Blocks location " << blocks_bbox << endl;
+            if (interleaved)
+                cerr << "Pixel interleaved, all bands in one pass" << endl;
         }
 
         // Build a vector of output bands
-        vector<GDALRasterBand *> src_b;
         vector<GDALRasterBand *> dst_b;
 
         for (int band = 1; band <= bands; band++)
-        {
-            src_b.push_back(pSDS->GetRasterBand(band));
             dst_b.push_back(pTDS->GetRasterBand(band));
+
+        // Buffer layout, the pixel space covers all bands if interleaved
+        GSpacing pixel_space = interleaved ? static_cast<GSpacing>(pixel_size) * bands : pixel_size;
+        GSpacing line_space = pixel_space * tsz_x;
+
+        // The content of a block which has only NoData, or zero if NoData is not defined
+        // For pixel interleaved there is a single one, for all bands
+        vector<vector<char>> empty_blocks;
+        for (int band = 0; band < (interleaved ? 1 : bands); band++)
+        {
+            empty_blocks.push_back(vector<char>(buffer_size, 0));
+            for (int b = band; b < (interleaved ? bands : band + 1); b++)
+            {
+                int has_ndv = FALSE;
+                double ndv = dst_b[b]->GetNoDataValue(&has_ndv);
+                if (has_ndv)
+                    GDALCopyWords(&ndv, GDT_Float64, 0,
+                                  empty_blocks.back().data() + (b - band) * pixel_size,
+                                  eDataType, static_cast<int>(pixel_space), tsz_x * tsz_y);
+            }
+        }
+
+        // The target index file, used to check that a tile exists before reading it
+        char **papszFiles = pTDS->GetFileList();
+        for (int i = 0; papszFiles != NULL && papszFiles[i] != NULL && idx_file == NULL; i++)
+        {
+            if (EQUAL(CPLGetExtension(papszFiles[i]), "idx"))
+                idx_file = VSIFOpenL(papszFiles[i], "rb");
+        }
+        CSLDestroy(papszFiles);
+        if (verbose != 0 && idx_file == NULL)
+        {
+            cerr << "Can't read the target index, edge tiles will always be read" << endl;
         }
 
-        buffer = CPLMalloc(buffer_size); // Enough for one block
+        // Level 0 tiles per row
+        int tiles_x = (pTDS->GetRasterXSize() + tsz_x - 1) / tsz_x;
+
+        // Blocks not written, for the report
+        atomic<int> skipped_empty(0);
+        atomic<int> skipped_same(0);
+
+        // The target dataset is not thread safe, all access to it is serialized
+        mutex target_lock;
+
+        // Blocks written by the earlier sources of this run
+        // Their index entries might still be buffered by the driver, they are not read from the index
+        vector<GUIntBig> written_before(dirty);
+        sort(written_before.begin(), written_before.end());
+        written_before.erase(unique(written_before.begin(), written_before.end()), written_before.end());
+
+        // Check the index to see if a level 0 tile exists in the target, without reading it
+        // Returns true if the index can't be read
+        auto tile_exists = [&](int x, int y, int band)
+        {
+            if (idx_file == NULL || binary_search(written_before.begin(), written_before.end(), tile_key(x, y)))
+                return true;
+            GUIntBig tile = static_cast<GUIntBig>(y) * tiles_x + x;
+            if (!interleaved)
+                tile = tile * bands + band;
+
+            // Index entries are offset and size, 64bit big endian
+            GUIntBig entry[2] = { 0, 0 };
+            lock_guard<mutex> guard(target_lock);
+            // A short read means the tile is past the end of the index, so it doesn't exist
+            if (VSIFSeekL(idx_file, tile * sizeof(entry), SEEK_SET) != 0)
+                return true;
+            if (1 != VSIFReadL(entry, sizeof(entry), 1, idx_file))
+                return false;
+            CPL_MSBPTR64(&entry[1]);
+            return entry[1] != 0;
+        };
+
+        // Read or write a block of the target, band -1 means all bands, interleaved
+        // Blocks at the right and bottom edges are clipped to the target size
+        auto target_io = [&](GDALRWFlag eRWFlag, int x, int y, int band, void *buffer)
+        {
+            int wx = min(tsz_x, pTDS->GetRasterXSize() - x * tsz_x);
+            int wy = min(tsz_y, pTDS->GetRasterYSize() - y * tsz_y);
+            lock_guard<mutex> guard(target_lock);
+            if (band < 0)
+                return pTDS->RasterIO(eRWFlag,
+                                      x * tsz_x, y * tsz_y,             // offset in output image
+                                      wx, wy,                           // Size in output image
+                                      buffer, wx, wy,                   // Buffer and size in buffer
+                                      eDataType,                        // Requested type
+                                      bands, NULL,                      // All bands
+                                      pixel_space, line_space, pixel_size, // Pixel, line and band space
+                                      NULL);                            // ExtraIO arguments
+            return dst_b[band]->RasterIO(eRWFlag,
+                                         x * tsz_x, y * tsz_y,  // offset in output image
+                                         wx, wy,                // Size in output image
+                                         buffer, wx, wy,        // Buffer and size in buffer
+                                         eDataType,             // Requested type
+                                         pixel_space, line_space, // Pixel and line space
+                                         NULL                   // ExtraIO arguments
+            );
+        };
+
+        // The pixels of a target block covered by the source, in target pixels
+        // The last ones are exclusive, the rectangle is empty if the block is outside the source
+        auto covered = [&](GDALDataset *pSrc, int x, int y, int &x0, int &y0, int &x1, int &y1)
+        {
+            x0 = max(x * tsz_x, static_cast<int>(ceil(origin.x)));
+            y0 = max(y * tsz_y, static_cast<int>(ceil(origin.y)));
+            x1 = min((x + 1) * tsz_x, static_cast<int>(floor(origin.x + pSrc->GetRasterXSize() * factor.x)));
+            y1 = min((y + 1) * tsz_y, static_cast<int>(floor(origin.y + pSrc->GetRasterYSize() * factor.y)));
+        };
+
+        //
+        // Read the source data for a target block, band -1 means all bands, interleaved
+        // Only the covered part of the buffer is modified
+        //
+        auto source_io = [&](GDALDataset *pSrc, int x, int y, int band, char *buffer) -> CPLErr
+        {
+            if (!resampled)
+            {
+                // Works just like RasterIO, except that it only reads the
+                // valid parts of the input band and has no scaling
+                int xoff = static_cast<int>(tsz_x * x - pix_bbox.lx);
+                int yoff = static_cast<int>(tsz_y * y - pix_bbox.uy);
+                if (band < 0)
+                    return ClippedRasterIO(pSrc, GF_Read,
+                                           xoff, yoff,       // offset in input image
+                                           tsz_x, tsz_y,     // Size in input image
+                                           buffer,           // buffer
+                                           eDataType,        // Requested type
+                                           bands,            // All bands
+                                           pixel_space, line_space, pixel_size);
+                return ClippedRasterIO(pSrc->GetRasterBand(band + 1), GF_Read,
+                                       xoff, yoff,
+                                       tsz_x, tsz_y,
+                                       buffer,
+                                       eDataType,
+                                       static_cast<int>(pixel_space), static_cast<int>(line_space));
+            }
+
+            int x0, y0, x1, y1;
+            covered(pSrc, x, y, x0, y0, x1, y1);
+            if (x0 >= x1 || y0 >= y1)
+                return CE_None;
+
+            // The matching source window, in floating point, GDAL does the resampling
+            GDALRasterIOExtraArg sExtraArg;
+            INIT_RASTERIO_EXTRA_ARG(sExtraArg);
+            sExtraArg.eResampleAlg = (Resampling == SAMPLING_Avg) ? GRIORA_Average : GRIORA_NearestNeighbour;
+            sExtraArg.bFloatingPointWindowValidity = TRUE;
+            sExtraArg.dfXOff = (x0 - origin.x) / factor.x;
+            sExtraArg.dfYOff = (y0 - origin.y) / factor.y;
+            sExtraArg.dfXSize = (x1 - x0) / factor.x;
+            sExtraArg.dfYSize = (y1 - y0) / factor.y;
+
+            // The integer window has to contain the floating point one
+            int nXOff = static_cast<int>(floor(sExtraArg.dfXOff));
+            int nYOff = static_cast<int>(floor(sExtraArg.dfYOff));
+            int nXSize = min(static_cast<int>(ceil(sExtraArg.dfXOff + sExtraArg.dfXSize)), pSrc->GetRasterXSize()) - nXOff;
+            int nYSize = min(static_cast<int>(ceil(sExtraArg.dfYOff + sExtraArg.dfYSize)), pSrc->GetRasterYSize()) - nYOff;
+
+            char *pData = buffer + (y0 - y * tsz_y) * line_space + (x0 - x * tsz_x) * pixel_space;
+            if (band < 0)
+                return pSrc->RasterIO(GF_Read, nXOff, nYOff, nXSize, nYSize,
+                                      pData, x1 - x0, y1 - y0, eDataType,
+                                      bands, NULL,
+                                      pixel_space, line_space, pixel_size,
+                                      &sExtraArg);
+            return pSrc->GetRasterBand(band + 1)->RasterIO(GF_Read, nXOff, nYOff, nXSize, nYSize,
+                                                           pData, x1 - x0, y1 - y0, eDataType,
+                                                           pixel_space, line_space,
+                                                           &sExtraArg);
+        };
+
+        // Read a target block into the buffer if the tile exists, otherwise the buffer is not modified
+        auto target_read = [&](int x, int y, int band, void *buffer, const char *message)
+        {
+            phase_timer timer(stats ? &stats->target_read : NULL);
+            if (!tile_exists(x, y, band))
+            {
+                if (stats != NULL)
+                    stats->reads_avoided++;
+                return;
+            }
+            CPLErr eErr = target_io(GF_Read, x, y, band, buffer);
+            if (CE_None != eErr)
+            {
+                cerr << message << endl;
+                throw static_cast<int>(eErr);
+            }
+            if (stats != NULL)
+            {
+                stats->target_reads++;
+                stats->target_bytes += buffer_size;
+            }
+        };
 
         //
-        // Use the innner loop for bands, helps if output is interleaved
+        // Insert a single block, all bands, using the given source and buffers
+        // Use the innner loop for bands, unless the output is pixel interleaved,
+        // in which case all bands are read and written at once, so every tile gets compressed once
         //
-        // Using the factor enables scaling of input
-        // However, the input coverage still has to be exactly on
-        // ouput block boundaries
+        // The input gets resampled if the resolutions are different,
+        // the block is padded with existing content where the input doesn't cover it
         //
-        if (start_level == 0) // Skip if start level is not zero
+        auto insert_block = [&](int x, int y, GDALDataset *pSrc, char *buffer, char *current)
         {
-            for (int y = static_cast<int>(blocks_bbox.uy); y <= static_cast<int>(blocks_bbox.ly); y++)
+            int x0, y0, x1, y1;
+            covered(pSrc, x, y, x0, y0, x1, y1);
+            if (x0 >= x1 || y0 >= y1)
+                return;
+
+            // If input doesn't cover the whole block, it needs padding
+            bool padding = x0 > x * tsz_x || x1 < (x + 1) * tsz_x || y0 > y * tsz_y || y1 < (y + 1) * tsz_y;
+            // and existing content, unless the input covers all of the block within the target
+            bool fill = x0 > x * tsz_x || x1 < min((x + 1) * tsz_x, pTDS->GetRasterXSize())
+                     || y0 > y * tsz_y || y1 < min((y + 1) * tsz_y, pTDS->GetRasterYSize());
+
+            bool written = false;
+            for (int pass = 0; pass < (interleaved ? 1 : bands); pass++)
             {
-                // Source offset relative to this block on y
-                int src_offset_y = static_cast<int>(factor.y * tsz_y * y - pix_bbox.uy);
+                int band = interleaved ? -1 : pass; // Counting from zero in a vector
+                if (verbose != 0)
+                {
+                    lock_guard<mutex> guard(target_lock);
+                    cerr << " Y block " << y << " X block " << x
+                         << " covered from " << x0 << "," << y0 << " to " << x1 << "," << y1 << endl;
+                }
+                // READ
+                if (stats != NULL)
+                    stats->blocks++;
+
+                CPLErr eErr = CE_None;
+                bool have_current = false;
+                // If input needs padding, initialize the buffer with destination content
+                if (padding)
+                {
+                    // NoData covers the parts outside of the target
+                    memcpy(buffer, empty_blocks[interleaved ? 0 : band].data(), buffer_size);
+                    // Only read the target if the tile exists, otherwise it would read as NoData
+                    if (fill)
+                        target_read(x, y, band, buffer, "Fill data read error");
+                    // This is also the current content
+                    // unless the source covers all of it, in which case it's not needed
+                    if (skip_unchanged && fill)
+                    {
+                        memcpy(current, buffer, buffer_size);
+                        have_current = true;
+                    }
+                }
 
-                for (int x = static_cast<int>(blocks_bbox.lx); x <= static_cast<int>(blocks_bbox.ux); x++)
                 {
-                    // Source offset relative to this block on x
-                    int src_offset_x = static_cast<int>(factor.x * tsz_x * x - pix_bbox.lx);
+                    phase_timer timer(stats ? &stats->source_read : NULL);
+                    eErr = source_io(pSrc, x, y, band, buffer);
+                }
+                if (stats != NULL)
+                    stats->source_bytes += static_cast<GIntBig>(x1 - x0) * (y1 - y0) * pixel_space;
+                if (CE_None != eErr)
+                {
+                    cerr << "Clipped rasterio read error" << endl;
+                    throw static_cast<int>(eErr);
+                }
 
-                    for (int band = 0; band < bands; band++) // Counting from zero in a vector
+                // Nothing to write if the block is empty
+                if (skip_empty && 0 == memcmp(buffer, empty_blocks[interleaved ? 0 : band].data(), buffer_size))
+                {
+                    skipped_empty++;
+                    continue;
+                }
+
+                // Or if the target already has the same content
+                if (skip_unchanged)
+                {
+                    if (!have_current)
                     {
-                        if (verbose != 0)
-                        {
-                            cerr << "src_offset_x = " << src_offset_x << " src_offset_y = " << src_offset_y << endl;
-                            cerr << " Y block " << y << " X block " << x << endl;
-                        }
-                        // READ
+                        memcpy(current, empty_blocks[interleaved ? 0 : band].data(), buffer_size);
+                        target_read(x, y, band, current, "Target read error");
+                    }
+                    if (0 == memcmp(buffer, current, buffer_size))
+                    {
+                        skipped_same++;
+                        continue;
+                    }
+                }
+
+                // WRITE
+                {
+                    phase_timer timer(stats ? &stats->target_write : NULL);
+                    eErr = target_io(GF_Write, x, y, band, buffer);
+                }
+                if (CE_None != eErr)
+                {
+                    cerr << "Write error" << endl;
+                    throw static_cast<int>(eErr);
+                }
+                if (stats != NULL)
+                {
+                    stats->written++;
+                    stats->written_bytes += buffer_size;
+                }
+                written = true;
+            }
+
+            // Parents of this block will need to be regenerated
+            if (written)
+            {
+                lock_guard<mutex> guard(target_lock);
+                dirty.push_back(tile_key(x, y));
+            }
+        };
 
-                        CPLErr eErr = CE_None;
-                        // If input needs padding, initialize the buffer with destination content
-                        if (src_offset_x < 0 || src_offset_x + tsz_x > src_b[band]->GetXSize() || src_offset_y < 0 || src_offset_y + tsz_y > src_b[band]->GetYSize())
+        if (start_level == 0) // Skip if start level is not zero
+        {
+            int first_row = static_cast<int>(blocks_bbox.uy);
+            int last_row = static_cast<int>(blocks_bbox.ly);
+
+            // Rows of blocks are handed out to the workers, one at a time
+            atomic<int> next_row(first_row);
+            atomic<int> error(0);
+
+            //
+            // Completed rows are flushed in order, in batches of flush_rows.
+            // The driver then appends the tiles to the data file and writes the index entries
+            // in sequence, instead of in the order the blocks get evicted from the cache
+            //
+            vector<char> row_done(last_row - first_row + 1, 0);
+            int done_row = first_row;    // First row not completed
+            int flushed_row = first_row; // First row not flushed
+            int flush = flush_rows;
+
+            // Every block is written only once, the cache only needs to hold the rows in progress
+            // Flush each row as soon as possible, so the blocks don't linger in the cache
+            if (cache_auto)
+            {
+                if (flush <= 0)
+                    flush = 1;
+                GIntBig row_bytes = static_cast<GIntBig>(blocks_bbox.ux - blocks_bbox.lx + 1)
+                                    * buffer_size * (interleaved ? 1 : bands);
+                set_cache(row_bytes * (threads + flush + 1));
+            }
+
+            auto row_complete = [&](int y)
+            {
+                lock_guard<mutex> guard(target_lock);
+                row_done[y - first_row] = 1;
+                while (done_row <= last_row && row_done[done_row - first_row])
+                    done_row++;
+                if (flush <= 0 || (done_row - flushed_row < flush && done_row <= last_row))
+                    return;
+                phase_timer timer(stats ? &stats->flush : NULL);
+
+                // FlushBlock writes a dirty block and drops it from the cache
+                for (; flushed_row < done_row; flushed_row++)
+                {
+                    for (int x = static_cast<int>(blocks_bbox.lx); x <= static_cast<int>(blocks_bbox.ux); x++)
+                    {
+                        // If interleaved, the first band writes the whole tile, the rest are dropped
+                        for (int band = 0; band < bands; band++)
                         {
-                            // Clunky solution to this problem, but GDAL API does not support padding
-                            if (x * tsz_x == dst_b[band]->GetXSize() || y * tsz_y == dst_b[band]->GetYSize())
-                            {
-                                continue;
-                            }
-                            eErr = dst_b[band]->RasterIO(GF_Read,
-                                                         x * tsz_x, y * tsz_y,  // offset in output image
-                                                         tsz_x, tsz_y,          // Size in output image
-                                                         buffer, tsz_x, tsz_y,  // Buffer and size in buffer
-                                                         eDataType,             // Requested type
-                                                         pixel_size, line_size, // Pixel and line space
-                                                         NULL                   // ExtraIO arguments
-                            );
-                            if (CE_None != eErr)
+                            if (CE_None != dst_b[band]->FlushBlock(x, flushed_row))
                             {
-                                cerr << "Fill data read error" << endl;
-                                throw static_cast<int>(eErr);
+                                cerr << "Write error" << endl;
+                                throw static_cast<int>(CE_Failure);
                             }
                         }
+                    }
+                }
+            };
 
-                        // Works just like RasterIO, except that it only reads the
-                        // valid parts of the input band and has no scaling
-                        eErr = ClippedRasterIO(src_b[band], GF_Read,
-                                               src_offset_x, src_offset_y, // offset in input image
-                                               tsz_x, tsz_y,               // Size in input image
-                                               buffer,                     // buffer
-                                               eDataType,                  // Requested type
-                                               pixel_size, line_size);     // Pixel and line space
-                        if (CE_None != eErr)
-                        {
-                            cerr << "Clipped rasterio read error" << endl;
-                            throw static_cast<int>(eErr);
-                        }
+            // Each worker reads from its own source dataset, into its own buffer
+            auto worker = [&](GDALDataset *pSrc)
+            {
+                vector<char> buffer(buffer_size); // Enough for one block, all bands if interleaved
+                vector<char> current(skip_unchanged ? buffer_size : 0); // Existing target content
 
-                        // WRITE
-                        eErr = dst_b[band]->RasterIO(GF_Write,
-                                                     x * tsz_x, y * tsz_y,  // offset in output image
-                                                     tsz_x, tsz_y,          // Size in output image
-                                                     buffer, tsz_x, tsz_y,  // Buffer and size in buffer
-                                                     eDataType,             // Requested type
-                                                     pixel_size, line_size, // Pixel and line space
-                                                     NULL                   // ExtraIO arguments
-                        );
-                        if (CE_None != eErr)
-                        {
-                            cerr << "Read error" << endl;
-                            throw static_cast<int>(eErr);
-                        }
+                try
+                {
+                    for (int y = next_row++; y <= last_row && !error; y = next_row++)
+                    {
+                        for (int x = static_cast<int>(blocks_bbox.lx); x <= static_cast<int>(blocks_bbox.ux); x++)
+                            insert_block(x, y, pSrc, buffer.data(), current.data());
+                        row_complete(y);
                     }
                 }
+                catch (int e)
+                {
+                    error = e;
+                }
+            };
+
+            // Additional source handles, one per extra thread
+            vector<GDALDatasetH> sources;
+            int workers = min(threads, last_row - first_row + 1);
+            for (int i = 1; i < workers; i++)
+            {
+                CPLPushErrorHandler(CPLQuietErrorHandler);
+                GDALDatasetH hSrc = GDALOpen(Source.c_str(), GA_ReadOnly);
+                CPLPopErrorHandler();
+                if (hSrc == NULL)
+                    break; // Use fewer threads
+                sources.push_back(hSrc);
+            }
+
+            vector<thread> pool;
+            for (auto hSrc : sources)
+                pool.emplace_back(worker, static_cast<GDALDataset *>(hSrc));
+            worker(pSDS);
+            for (auto &t : pool)
+                t.join();
+            for (auto hSrc : sources)
+                GDALClose(hSrc);
+
+            if (error)
+                throw static_cast<int>(error);
+
+            if (stats != NULL)
+            {
+                stats->skipped_empty += skipped_empty;
+                stats->skipped_same += skipped_same;
+            }
+
+            if (verbose != 0 && (skip_empty || skip_unchanged))
+            {
+                cerr << "Skipped " << skipped_empty << " empty and "
+                     << skipped_same << " unchanged blocks" << endl;
             }
         }
-        CPLFree(buffer);
+        else
+        {
+            // Base level is not modified, but the overviews within the source footprint are
+            for (int y = static_cast<int>(blocks_bbox.uy); y <= static_cast<int>(blocks_bbox.ly); y++)
+                for (int x = static_cast<int>(blocks_bbox.lx); x <= static_cast<int>(blocks_bbox.ux); x++)
+                    dirty.push_back(tile_key(x, y));
+        }
     }
-    catch (int e)
+    catch (int)
     {
-        if (e > 0)
-            GDALClose(hDataset);
-        CPLFree(buffer);
+        if (idx_file != NULL)
+            VSIFCloseL(idx_file);
+        GDALClose(hPatch);
         return false;
     }
 
-    // Close input, flush output, then worry about overviews
+    if (idx_file != NULL)
+        VSIFCloseL(idx_file);
+
+    // Close input
     GDALClose(hPatch);
-    GDALFlushCache(hDataset);
+    return true;
+}
 
-    // Call the patchOverview for the MRF
-    if (overlays)
+// Update the overviews for the modified level 0 blocks, between start_level and stop_level
+// Every modified parent tile is generated exactly once, from the level below
+bool state::overviews(MRFDataset *pTarg, vector<GUIntBig> &dirty, run_stats *stats)
+{
+    int overview_count = pTarg->GetRasterBand(1)->GetOverviewCount();
+
+    // If stop level is not set, do all levels
+    int last_level = (stop_level < 0 || stop_level > overview_count) ? overview_count : stop_level;
+    int first_level = max(start_level, 1);
+
+    // The overview tiles are read again to build the next level, keep them all in the cache
+    // Together they are about a third of the base level
+    if (cache_auto)
     {
-        auto BlockXOut = static_cast<int>(blocks_bbox.lx);
-        auto BlockYOut = static_cast<int>(blocks_bbox.uy);
-        // correct off-by-one error when generating overlays
-        auto WidthOut = static_cast<int>(blocks_bbox.ux - blocks_bbox.lx + 1);
-        auto HeightOut = static_cast<int>(blocks_bbox.ly - blocks_bbox.uy + 1);
+        GDALRasterBand *b0 = pTarg->GetRasterBand(1);
+        int tsz_x, tsz_y;
+        b0->GetBlockSize(&tsz_x, &tsz_y);
+        GIntBig tile_bytes = static_cast<GIntBig>(tsz_x) * tsz_y * pTarg->GetRasterCount()
+                             * (GDALGetDataTypeSize(b0->GetRasterDataType()) / 8);
+        set_cache(static_cast<GIntBig>(dirty.size()) * tile_bytes / 3 + 4 * tile_bytes * threads);
+    }
+
+    for (int level = 1; level <= last_level && !dirty.empty(); level++)
+    {
+        // Move the dirty tiles to their parents
+        for (auto &key : dirty)
+            key = tile_key(tile_x(key) / 2, tile_y(key) / 2);
+        sort(dirty.begin(), dirty.end());
+        dirty.erase(unique(dirty.begin(), dirty.end()), dirty.end());
+
+        if (level < first_level)
+            continue;
 
-        // If stop level is not set, do all levels
-        if (stop_level == -1)
+        if (verbose != 0)
         {
-            stop_level = overview_count;
+            cerr << "Level " << level << " has " << dirty.size() << " modified tiles" << endl;
         }
 
-        // convert level limits to source levels
-        start_level--;
+        // Time spent on the level, CPU time over all the threads
+        phase_time timing;
+        GIntBig wall = wall_ns();
+        GIntBig cpu = thread_cpu_ns();
+
+        // Generate the tiles, the same way for any number of threads, so the output doesn't depend on it
+        level_result result = overview_level(pTarg, level, dirty, stats ? &timing : NULL);
+        if (LEVEL_ERROR == result)
+            return false;
+        if (LEVEL_OK == result)
+        {
+            if (stats != NULL)
+            {
+                run_stats::level_time lt = { level, static_cast<GIntBig>(dirty.size()), wall_ns() - wall, timing.cpu };
+                stats->levels.push_back(lt);
+            }
+            continue;
+        }
+
+        // Data type not supported by Decimate, let the driver do it
+        // One call for each run of adjacent tiles in a row, the source rectangle at
+        // the level below is aligned, so only the dirty tiles are generated
+        for (size_t i = 0; i < dirty.size();)
+        {
+            size_t j = i + 1;
+            while (j < dirty.size() && dirty[j] == dirty[j - 1] + 1)
+                j++;
+
+            CPLErr eErr = pTarg->PatchOverview(2 * tile_x(dirty[i]), 2 * tile_y(dirty[i]),
+                                               2 * static_cast<int>(j - i), 2,
+                                               level - 1, false, Resampling);
+            if (CE_None != eErr)
+            {
+                cerr << "Overview generation error" << endl;
+                return false;
+            }
+            i = j;
+        }
 
-        // Use recursive mode to have the MRF driver handle overviews automatically
-        pTarg->PatchOverview(BlockXOut, BlockYOut, WidthOut, HeightOut,
-                             0, true, Resampling);
-        GDALFlushCache(hDataset);
+        if (stats != NULL)
+        {
+            run_stats::level_time lt = { level, static_cast<GIntBig>(dirty.size()), wall_ns() - wall,
+                                         thread_cpu_ns() - cpu };
+            stats->levels.push_back(lt);
+        }
     }
 
-    // Now for the upper levels
-    GDALFlushCache(hDataset);
-    GDALClose(hDataset);
     return true;
 }
 
+// Set the GDAL cache size, with a lower limit and within half of the physical memory
+void state::set_cache(GIntBig bytes)
+{
+    const GIntBig min_cache = 64 * 1024 * 1024;
+    GIntBig max_cache = CPLGetUsablePhysicalRAM() / 2;
+    if (max_cache < min_cache)
+        max_cache = min_cache;
+    bytes = min(max(bytes, min_cache), max_cache);
+    if (verbose != 0)
+    {
+        cerr << "Cache size " << bytes / 1024 / 1024 << "MB" << endl;
+    }
+    GDALSetCacheMax64(bytes);
+}
+
+// A string as a JSON value
+static string json_string(const string &value)
+{
+    string out("\"");
+    for (unsigned char c : value)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (c < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+            continue;
+        }
+        out += static_cast<char>(c);
+    }
+    return out + "\"";
+}
+
+// A phase as a JSON object, times in seconds
+static string json_phase(const phase_time &phase)
+{
+    ostringstream out;
+    out << "{\"wall\":" << phase.wall / 1e9 << ",\"cpu\":" << phase.cpu / 1e9
+        << ",\"calls\":" << phase.count << "}";
+    return out.str();
+}
+
+void state::write_stats(const string &Source, const run_stats &stats)
+{
+    ostringstream out;
+    out << "{\"target\":" << json_string(TargetName);
+    if (!Source.empty())
+        out << ",\"source\":" << json_string(Source);
+    out << ",\"threads\":" << threads;
+    out << ",\"time\":{\"total\":{\"wall\":" << stats.total.wall / 1e9
+        << ",\"cpu\":" << stats.total.cpu / 1e9 << "}";
+    if (!Source.empty())
+        out << ",\"open\":" << json_phase(stats.open)
+            << ",\"source_read\":" << json_phase(stats.source_read)
+            << ",\"target_read\":" << json_phase(stats.target_read)
+            << ",\"target_write\":" << json_phase(stats.target_write);
+    out << ",\"flush\":" << json_phase(stats.flush) << "}";
+    if (!Source.empty())
+    {
+        out << ",\"blocks\":{\"processed\":" << stats.blocks
+            << ",\"written\":" << stats.written
+            << ",\"skipped_empty\":" << stats.skipped_empty
+            << ",\"skipped_unchanged\":" << stats.skipped_same
+            << ",\"target_reads\":" << stats.target_reads
+            << ",\"reads_avoided\":" << stats.reads_avoided << "}";
+        out << ",\"bytes\":{\"source_read\":" << stats.source_bytes
+            << ",\"target_read\":" << stats.target_bytes
+            << ",\"written\":" << stats.written_bytes;
+    }
+    else
+    {
+        out << ",\"levels\":[";
+        for (size_t i = 0; i < stats.levels.size(); i++)
+            out << (i ? "," : "") << "{\"level\":" << stats.levels[i].level
+                << ",\"tiles\":" << stats.levels[i].tiles
+                << ",\"wall\":" << stats.levels[i].wall / 1e9
+                << ",\"cpu\":" << stats.levels[i].cpu / 1e9 << "}";
+        out << "],\"bytes\":{";
+    }
+    out << (Source.empty() ? "" : ",") << "\"data_added\":" << stats.data_added
+        << ",\"index_added\":" << stats.index_added << "}";
+    out << ",\"cache\":{\"max\":" << GDALGetCacheMax64()
+        << ",\"used\":" << stats.cache_used << "}}" << endl;
+
+    if (StatsName == "-")
+    {
+        cerr << out.str();
+        return;
+    }
+    FILE *f = fopen(StatsName.c_str(), "a");
+    if (f == NULL)
+    {
+        CPLError(CE_Warning, CPLE_AppDefined, "Can't open stats file %s", StatsName.c_str());
+        return;
+    }
+    fputs(out.str().c_str(), f);
+    fclose(f);
+}
+
+//
+// Generate the given tiles of an overview level from the level below, on one or more threads
+// Returns LEVEL_UNSUPPORTED before doing anything if the data type is not supported,
+// LEVEL_ERROR if reading or writing the target fails, which is reported
+// The time spent by the workers is added to timing, unless it is NULL
+//
+// Access to the target is serialized, including the tile decompression and compression
+// done by the driver, only the resampling happens in parallel.
+// The level is complete when this returns, so it acts as a barrier between levels
+//
+state::level_result state::overview_level(MRFDataset *pTarg, int level, const vector<GUIntBig> &tiles,
+                                          phase_time *timing)
+{
+    GDALRasterBand *b0 = pTarg->GetRasterBand(1);
+    int bands = pTarg->GetRasterCount();
+    int tsz_x, tsz_y;
+    b0->GetBlockSize(&tsz_x, &tsz_y);
+    GDALDataType eDataType = b0->GetRasterDataType();
+    int pixel_size = GDALGetDataTypeSize(eDataType) / 8;
+
+    // Check that the type is supported
+    if (!Decimate(eDataType, NULL, 0, 0, NULL, 0, 0, false, FALSE, 0))
+        return LEVEL_UNSUPPORTED;
+
+    // Source and destination bands
+    vector<GDALRasterBand *> src_b;
+    vector<GDALRasterBand *> dst_b;
+    vector<double> ndv;
+    vector<int> has_ndv;
+    for (int band = 1; band <= bands; band++)
+    {
+        GDALRasterBand *b = pTarg->GetRasterBand(band);
+        src_b.push_back(level == 1 ? b : b->GetOverview(level - 2));
+        dst_b.push_back(b->GetOverview(level - 1));
+        int success = FALSE;
+        ndv.push_back(b->GetNoDataValue(&success));
+        has_ndv.push_back(success);
+    }
+
+    mutex target_lock;
+    atomic<size_t> next(0);
+    atomic<int> error(0);
+
+    auto worker = [&]()
+    {
+        phase_timer timer(timing);
+        vector<char> input(4 * static_cast<size_t>(tsz_x) * tsz_y * pixel_size);
+        vector<char> output(static_cast<size_t>(tsz_x) * tsz_y * pixel_size);
+
+        for (size_t i = next++; i < tiles.size() && !error; i = next++)
+        {
+            int x = tile_x(tiles[i]);
+            int y = tile_y(tiles[i]);
+            for (int band = 0; band < bands; band++)
+            {
+                // The 2x2 source tiles, clipped to the level below
+                int src_x = 2 * x * tsz_x;
+                int src_y = 2 * y * tsz_y;
+                int xsz = min(2 * tsz_x, src_b[band]->GetXSize() - src_x);
+                int ysz = min(2 * tsz_y, src_b[band]->GetYSize() - src_y);
+
+                // Clipped output tile
+                int wx = min(tsz_x, dst_b[band]->GetXSize() - x * tsz_x);
+                int wy = min(tsz_y, dst_b[band]->GetYSize() - y * tsz_y);
+                if (xsz <= 0 || ysz <= 0 || wx <= 0 || wy <= 0)
+                    continue;
+
+                CPLErr eErr;
+                {
+                    lock_guard<mutex> guard(target_lock);
+                    eErr = src_b[band]->RasterIO(GF_Read, src_x, src_y, xsz, ysz,
+                                                 input.data(), xsz, ysz, eDataType,
+                                                 pixel_size, 2 * tsz_x * pixel_size, NULL);
+                }
+                if (CE_None != eErr)
+                {
+                    error = static_cast<int>(eErr);
+                    break;
+                }
+
+                Decimate(eDataType, input.data(), xsz, ysz, output.data(), tsz_x, tsz_y,
+                         Resampling == SAMPLING_Avg, has_ndv[band], ndv[band]);
+
+                lock_guard<mutex> guard(target_lock);
+                eErr = dst_b[band]->RasterIO(GF_Write, x * tsz_x, y * tsz_y, wx, wy,
+                                             output.data(), wx, wy, eDataType,
+                                             pixel_size, tsz_x * pixel_size, NULL);
+                if (CE_None != eErr)
+                {
+                    error = static_cast<int>(eErr);
+                    break;
+                }
+            }
+        }
+    };
+
+    vector<thread> pool;
+    size_t workers = min(static_cast<size_t>(threads), tiles.size());
+    for (size_t i = 1; i < workers; i++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+
+    if (error)
+    {
+        cerr << "Overview generation error" << endl;
+        return LEVEL_ERROR;
+    }
+    return LEVEL_OK;
+}
+
 /************************************************************************/
 /*                               Usage()                                */
 /************************************************************************/
@@ -411,8 +1306,15 @@ static int Usage()
         "\t\t[-q] [--help-general] source_file(s) target_file\n"
         "\n"
         "\t-start_level <N> : first level to insert into (0)\n"
-        "\t-end_level <N> : last level to insert into (last)\n"
-        "\t-r : choice of resampling method (default: average)\n"
+        "\t-stop_level <N> : last level to insert into (last)\n"
+        "\t-r : choice of resampling method, for overviews and input (default: average)\n"
+        "\t-batch : open the target once and update the overviews once, after all sources\n"
+        "\t-j <N> : number of threads used for inserting blocks (1)\n"
+        "\t-flush_rows <N> : write the inserted blocks in order, every N rows of blocks\n"
+        "\t-cache {auto, <MB>} : GDAL cache size, auto sizes it for each phase (256)\n"
+        "\t-skip_empty : don't write blocks which are all NoData, or zero if NoData is not set\n"
+        "\t-skip_unchanged : don't write blocks which have the same content as the target\n"
+        "\t-stats <file> : append a JSON line of timings and counts per source and for the overviews, - for stderr\n"
         "\t-q : turn off progress display\n");
 
     return 1;
@@ -422,6 +1324,7 @@ int main(int nArgc, char **papszArgv)
 {
     state State;
     int ret = 0;
+    bool batch = false;
 
     std::vector<std::string> fnames;
 
@@ -472,6 +1375,38 @@ int main(int nArgc, char **papszArgv)
         {
             State.setStop(strtol(papszArgv[++iArg], 0, 0));
         }
+        else if (EQUAL(papszArgv[iArg], "-j") && iArg < nArgc - 1)
+        {
+            State.setThreads(strtol(papszArgv[++iArg], 0, 0));
+        }
+        else if (EQUAL(papszArgv[iArg], "-flush_rows") && iArg < nArgc - 1)
+        {
+            State.setFlushRows(strtol(papszArgv[++iArg], 0, 0));
+        }
+        else if (EQUAL(papszArgv[iArg], "-cache") && iArg < nArgc - 1)
+        {
+            iArg++;
+            if (EQUAL(papszArgv[iArg], "auto"))
+                State.setCacheAuto();
+            else
+                GDALSetCacheMax64(static_cast<GIntBig>(strtol(papszArgv[iArg], 0, 0)) * 1024 * 1024);
+        }
+        else if (EQUAL(papszArgv[iArg], "-stats") && iArg < nArgc - 1)
+        {
+            State.setStats(papszArgv[++iArg]);
+        }
+        else if (EQUAL(papszArgv[iArg], "-batch"))
+        {
+            batch = true;
+        }
+        else if (EQUAL(papszArgv[iArg], "-skip_empty"))
+        {
+            State.setSkipEmpty();
+        }
+        else if (EQUAL(papszArgv[iArg], "-skip_unchanged"))
+        {
+            State.setSkipUnchanged();
+        }
         else if (EQUAL(papszArgv[iArg], "-r") && iArg < nArgc - 1)
         {
             // R is required for building overviews
@@ -506,8 +1441,14 @@ int main(int nArgc, char **papszArgv)
 
     try
     {
+        // All inputs in a single pass
+        if (batch && !State.patch(fnames))
+        {
+            throw 2;
+        }
+
         // Each input file in sequence, as they were passed as arguments
-        for (int i = 0; i < fnames.size(); i++)
+        for (int i = 0; !batch && i < fnames.size(); i++)
         {
             State.setSource(fnames[i]);
 
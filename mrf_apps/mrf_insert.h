@@ -47,6 +47,7 @@
 
 #include <vector>
 #include <string>
+#include <atomic>
 
 // generic bounds
 struct Bounds {
@@ -72,6 +73,50 @@ struct img_info {
     XY res;
 };
 
+// Time spent in a phase, summed over all the threads, in nanoseconds
+struct phase_time {
+    phase_time() : wall(0), cpu(0), count(0) {}
+    std::atomic<GIntBig> wall;
+    std::atomic<GIntBig> cpu; // Thread CPU time, zero where not available
+    std::atomic<GIntBig> count;
+};
+
+// Counters for one source or for the overviews, collected with -stats
+struct run_stats {
+    run_stats() : blocks(0), written(0), skipped_empty(0), skipped_same(0),
+        target_reads(0), reads_avoided(0), source_bytes(0), target_bytes(0), written_bytes(0),
+        data_added(0), index_added(0), cache_used(0)
+    {};
+
+    phase_time total; // Wall time of the calling thread, CPU time of the process
+    phase_time open;
+    phase_time source_read;
+    phase_time target_read; // Fill and compare reads of existing target blocks
+    phase_time target_write; // Into the GDAL cache, tiles are compressed when flushed
+    phase_time flush;
+
+    std::atomic<GIntBig> blocks; // Block passes, one per band unless interleaved
+    std::atomic<GIntBig> written;
+    std::atomic<GIntBig> skipped_empty;
+    std::atomic<GIntBig> skipped_same;
+    std::atomic<GIntBig> target_reads;
+    std::atomic<GIntBig> reads_avoided; // Target reads not needed, the index has no tile
+    std::atomic<GIntBig> source_bytes;
+    std::atomic<GIntBig> target_bytes;
+    std::atomic<GIntBig> written_bytes; // Uncompressed
+
+    GIntBig data_added; // Growth of the target files
+    GIntBig index_added;
+    GIntBig cache_used; // GDAL cache in use before the flush
+
+    // Overviews, per level
+    struct level_time {
+        int level;
+        GIntBig tiles, wall, cpu;
+    };
+    std::vector<level_time> levels;
+};
+
 class state {
 
 public:
@@ -80,12 +125,20 @@ public:
         verbose(false),
         overlays(false),
     start_level(0), // From begining
-    stop_level(-1)  // To end
+    stop_level(-1), // To end
+    threads(1),
+    skip_empty(false),
+    skip_unchanged(false),
+    flush_rows(0),
+    cache_auto(false)
     {};
 
     // Insert the target in the source, based on internal coordinates
     bool patch(void);
 
+    // Insert all the sources, opening the target only once
+    bool patch(const std::vector<std::string> &Sources);
+
     void setStart(int level) { start_level = level; }
 
     void setStop(int level) { stop_level = level; }
@@ -100,6 +153,19 @@ public:
 
     void setDebug(int level) { verbose = level; }
 
+    void setThreads(int count) { threads = count > 0 ? count : 1; }
+
+    void setSkipEmpty() { skip_empty = true; }
+
+    void setSkipUnchanged() { skip_unchanged = true; }
+
+    void setFlushRows(int rows) { flush_rows = rows; }
+
+    void setCacheAuto() { cache_auto = true; }
+
+    // Append a JSON summary of each source and of the overviews to this file, - for stderr
+    void setStats(const std::string &name) { StatsName = name; }
+
     void setResampling(const std::string &Resamp) {
     if (EQUALN(Resamp.c_str(), "Avg", 3))
         Resampling = GDAL_MRF::SAMPLING_Avg;
@@ -108,12 +174,39 @@ public:
     }
 
 private:
+    // Insert one source in the open target, adds the modified level 0 blocks to dirty
+    // Counts and timings go in stats, unless it is NULL
+    bool insert(GDALDataset *pTDS, const std::string &Source, std::vector<GUIntBig> &dirty,
+                run_stats *stats);
+
+    // Update the overviews of the modified level 0 blocks, dirty is consumed
+    bool overviews(GDAL_MRF::MRFDataset *pTarg, std::vector<GUIntBig> &dirty, run_stats *stats);
+
+    // Result of overview_level, the level is generated by PatchOverview when unsupported
+    enum level_result { LEVEL_UNSUPPORTED, LEVEL_OK, LEVEL_ERROR };
+
+    // Generate some tiles of an overview level, on multiple threads
+    level_result overview_level(GDAL_MRF::MRFDataset *pTarg, int level, const std::vector<GUIntBig> &tiles,
+                                phase_time *timing);
+
+    // Set the GDAL cache, within limits
+    void set_cache(GIntBig bytes);
+
+    // Append the stats as one line of JSON, Source is empty for the overviews
+    void write_stats(const std::string &Source, const run_stats &stats);
+
     int verbose;
     int overlays;
     int start_level;
     int stop_level;
+    int threads; // Threads for level 0 insert and for overviews
+    bool skip_empty; // Don't write NoData blocks
+    bool skip_unchanged; // Don't write blocks that are already in the target
+    int flush_rows; // Flush the level 0 blocks in order, every this many rows
+    bool cache_auto; // Size the GDAL cache for each phase
     std::string TargetName;
     std::string SourceName;
+    std::string StatsName; // Empty when stats are not collected
     int Resampling;
     GDALProgressFunc Progress;
 };
@@ -0,0 +1,462 @@
+/*
+ * file: mrf_join.cpp
+ *
+ * Joins MRF files with the same structure into a single one, same options as mrf_join.py
+ *
+ * mrf_join [-f offset] <inputs ...> <output>
+ * mrf_join -o <output> [-f offset] <inputs ...>
+ * mrf_join -o <output> -z <zsize> [-s slice] <inputs ...>
+ *
+ * File names are data file names, the .idx and .mrf files are in the same location.
+ *
+ * The input data files are appended to the output data file, by cloning the extents when
+ * the file system supports it and the output is block aligned, otherwise with
+ * copy_file_range, or read and write as a last resort.
+ * Only the allocated regions of the input index files are read. The existing tiles are
+ * rebased in bulk, the byte swap and the offset addition being done on two index entries
+ * at a time with AVX2, or on one with NEON. The output index blocks that don't receive
+ * tiles are not written, so the output index stays sparse.
+ * Identical tiles are not deduplicated, mrf_clean -d does that on the joined MRF.
+ *
+ */
+
+#include "mrf_index.h"
+#include "mrf_meta.h"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define HAVE_AVX2
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON
+#endif
+
+using namespace std;
+
+const static int BUFSZ(1024 * 1024); // Data copy and index chunk size
+const static size_t BLOCK_ENTRIES(512 / sizeof(tinfo)); // Index entries in a 512 byte block
+
+int Usage(const string &s) {
+    cerr << s << endl << endl
+    << "Synopsis: mrf_join [OPTIONS] <input data files> [output data file]\n"
+    << "\tFile names are MRF data file names, the .idx and .mrf files are in the same location\n"
+    << "\t-o name\tOutput file name, otherwise the last file name is the output\n"
+    << "\t-z N\tThe output is a 3rd dimension MRF with N slices, inputs are inserted as slices\n"
+    << "\t-s N\tUsed only with -z, the first target slice, defaults to 0\n"
+    << "\t-f N\tOffset used when adding one input index to the output, data files are ignored\n";
+    return 1;
+}
+
+//
+// Index rebasing kernels
+// Entries in src that hold a tile, with a non-zero size, are copied to dst with
+// offset added. The other dst entries are not modified. Both are big endian
+//
+
+static void rebase_scalar(const tinfo *src, tinfo *dst, size_t n, uint64_t offset) {
+    for (size_t i = 0; i < n; i++) {
+        if (!src[i].size)
+            continue;
+        dst[i].offset = htobe64(be64toh(src[i].offset) + offset);
+        dst[i].size = src[i].size;
+    }
+}
+
+#if defined(HAVE_AVX2)
+TARGET_AVX2 static void rebase_avx2(const tinfo *src, tinfo *dst, size_t n, uint64_t offset) {
+    // Swaps the bytes of every 64bit value, each 128bit lane holds one entry
+    const __m256i swap = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i add = _mm256_setr_epi64x(offset, 0, offset, 0);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+        // All ones for the entries with a zero size, from the size lane of each entry
+        __m256i empty = _mm256_shuffle_epi32(_mm256_cmpeq_epi64(v, zero), 0xEE);
+        __m256i r = _mm256_shuffle_epi8(_mm256_add_epi64(_mm256_shuffle_epi8(v, swap), add), swap);
+        __m256i old = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_blendv_epi8(r, old, empty));
+    }
+    rebase_scalar(src + i, dst + i, n - i, offset);
+}
+
+static bool has_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#if defined(HAVE_NEON)
+static void rebase_neon(const tinfo *src, tinfo *dst, size_t n, uint64_t offset) {
+    const uint64x2_t add = vcombine_u64(vcreate_u64(offset), vcreate_u64(0));
+    for (size_t i = 0; i < n; i++) {
+        uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t *>(src + i));
+        uint64x2_t r = vreinterpretq_u64_u8(vrev64q_u8(v));
+        if (!vgetq_lane_u64(r, 1))
+            continue;
+        r = vaddq_u64(r, add);
+        vst1q_u8(reinterpret_cast<uint8_t *>(dst + i), vrev64q_u8(vreinterpretq_u8_u64(r)));
+    }
+}
+#endif
+
+// Pick the rebasing kernel, once
+static void (*select_rebase())(const tinfo *, tinfo *, size_t, uint64_t) {
+#if defined(HAVE_AVX2)
+    if (has_avx2())
+        return rebase_avx2;
+#elif defined(HAVE_NEON)
+    return rebase_neon;
+#endif
+    return rebase_scalar;
+}
+
+static void (* const rebase)(const tinfo *, tinfo *, size_t, uint64_t) = select_rebase();
+
+// Returns true if the entries are all zero
+static bool no_tiles(const tinfo *src, size_t n) {
+    uint64_t accumulator = 0;
+    for (size_t i = 0; i < n; i++)
+        accumulator |= src[i].offset | src[i].size;
+    return 0 == accumulator;
+}
+
+// A run of input index entries, placed at a given output entry
+struct segment {
+    uint64_t start; // In the input index, in entries
+    uint64_t count;
+    uint64_t out; // Output position of start
+};
+
+// Rebase the tiles of the input index and write them into the output index
+// Only the allocated parts of the input are read, the output blocks for which the
+// input is empty are not written
+static string rebase_index(const string &inname, int fdout, const vector<segment> &segments,
+    uint64_t offset)
+{
+    FILE *finidx = fopen(inname.c_str(), "rb");
+    if (!finidx)
+        return "Can't open index " + inname;
+    FSEEK(finidx, 0, SEEK_END);
+    uint64_t isize = FTELL(finidx);
+    int fdin = fileno(finidx);
+    vector<tinfo> in(BUFSZ / sizeof(tinfo)), out(BUFSZ / sizeof(tinfo));
+    string err;
+    for (auto &range : allocated_ranges(finidx, isize)) {
+        uint64_t rstart = range.start / sizeof(tinfo);
+        uint64_t rend = (range.end + sizeof(tinfo) - 1) / sizeof(tinfo);
+        for (auto &seg : segments) {
+            uint64_t pos = max(rstart, seg.start);
+            uint64_t end = min(rend, seg.start + seg.count);
+            while (err.empty() && pos < end) {
+                size_t n = static_cast<size_t>(min<uint64_t>(in.size(), end - pos));
+                uint64_t opos = seg.out + pos - seg.start;
+                char *pin = reinterpret_cast<char *>(in.data());
+                char *pout = reinterpret_cast<char *>(out.data());
+                if (!pread_all(fdin, pin, n * sizeof(tinfo), pos * sizeof(tinfo))) {
+                    err = "Error reading index " + inname;
+                    break;
+                }
+                // The output may be shorter, or sparse, missing parts are zero
+                ssize_t got = pread(fdout, pout, n * sizeof(tinfo), opos * sizeof(tinfo));
+                if (got < 0) {
+                    err = "Error reading output index";
+                    break;
+                }
+                memset(pout + got, 0, n * sizeof(tinfo) - got);
+                // Work in input blocks, writing back only the ones that change
+                for (size_t b = 0; b < n;) {
+                    size_t len = min(BLOCK_ENTRIES, n - b);
+                    if (no_tiles(&in[b], len)) {
+                        b += len;
+                        continue;
+                    }
+                    size_t first = b;
+                    while (b < n && !no_tiles(&in[b], min(BLOCK_ENTRIES, n - b)))
+                        b += min(BLOCK_ENTRIES, n - b);
+                    rebase(&in[first], &out[first], b - first, offset);
+                    if (!pwrite_all(fdout, pout + first * sizeof(tinfo), (b - first) * sizeof(tinfo),
+                        (opos + first) * sizeof(tinfo)))
+                    {
+                        err = "Error writing output index";
+                        break;
+                    }
+                }
+                pos += n;
+            }
+        }
+        if (!err.empty())
+            break;
+    }
+    fclose(finidx);
+    return err;
+}
+
+// Append the input data file to the output, returns the offset where it was placed
+static string append_data(const string &inname, int fdout, uint64_t &offset) {
+    struct stat statb;
+    if (fstat(fdout, &statb))
+        return "Can't stat output data file";
+    offset = statb.st_size;
+    uint64_t blksize = statb.st_blksize ? statb.st_blksize : 4096;
+    int fdin = open(inname.c_str(), O_RDONLY);
+    if (fdin < 0 || fstat(fdin, &statb)) {
+        if (fdin >= 0)
+            close(fdin);
+        return "Can't open input data file " + inname;
+    }
+    uint64_t size = statb.st_size;
+    bool done = (0 == size);
+#if defined(FICLONERANGE)
+    // Share the extents, needs the destination to be block aligned, the length can be to EOF
+    if (!done && 0 == offset % blksize) {
+        struct file_clone_range range;
+        range.src_fd = fdin;
+        range.src_offset = 0;
+        range.src_length = 0; // To the end of file
+        range.dest_offset = offset;
+        done = (0 == ioctl(fdout, FICLONERANGE, &range));
+    }
+#endif
+    vector<char> buffer;
+    if (!done) {
+        buffer.resize(BUFSZ);
+        done = copy_data(fdin, fdout, 0, offset, size, buffer);
+    }
+    close(fdin);
+    return done ? string() : "Error appending " + inname;
+}
+
+static bool exists(const string &name) {
+    struct stat statb;
+    return 0 == stat(name.c_str(), &statb);
+}
+
+static int64_t file_size(const string &name) {
+    struct stat statb;
+    if (stat(name.c_str(), &statb))
+        return -1;
+    return statb.st_size;
+}
+
+static bool write_file(const string &name, const string &content) {
+    ofstream f(name, ios::binary | ios::trunc);
+    f << content;
+    return bool(f);
+}
+
+// Joins 2D MRFs, the output is the last name
+static string mrf_join(const vector<string> &names, bool forced, uint64_t forceoffset) {
+    string ext = extension(names.back());
+    string oname = basename_noext(names.back());
+    if (ext == ".mrf" || ext == ".idx")
+        return "Takes data file names as input, not the .mrf or .idx";
+    vector<string> inputs(names.begin(), names.end() - 1);
+    for (auto &f : inputs)
+        if (extension(f) != ext)
+            return "All input files should have the same extension";
+
+    if (!exists(names.back())) {
+        // Create the output using the first file info
+        string fname = basename_noext(inputs[0]);
+        string mrf;
+        if (!read_file(fname + ".mrf", mrf) || !write_file(oname + ".mrf", mrf))
+            return "Can't copy " + fname + ".mrf";
+        int64_t isize = file_size(fname + ".idx");
+        FILE *f = fopen((oname + ".idx").c_str(), "wb");
+        if (isize < 0 || !f || !SETSPARSE(f) || ftruncate(fileno(f), isize)) {
+            if (f)
+                fclose(f);
+            return "Can't create output index";
+        }
+        fclose(f);
+        // Only create the data file if the offset is not given
+        if (!forced) {
+            f = fopen(names.back().c_str(), "wb");
+            if (!f)
+                return "Can't create output data file";
+            fclose(f);
+        }
+    }
+
+    int64_t idxsize = file_size(oname + ".idx");
+    for (auto &f : inputs)
+        if (file_size(basename_noext(f) + ".idx") != idxsize)
+            return "All input index files should have the same size " + to_string(idxsize)
+                + ", " + f + " does not";
+
+    int fdout = forced ? -1 : open(names.back().c_str(), O_WRONLY);
+    int fdidx = open((oname + ".idx").c_str(), O_RDWR);
+    string err;
+    if ((!forced && fdout < 0) || fdidx < 0)
+        err = "Can't open output";
+    vector<segment> segments(1, {0, uint64_t(idxsize) / sizeof(tinfo), 0});
+    for (auto &f : inputs) {
+        if (!err.empty())
+            break;
+        cout << "Processing " << f << endl;
+        uint64_t offset = forceoffset;
+        if (!forced)
+            err = append_data(f, fdout, offset);
+        if (err.empty())
+            err = rebase_index(basename_noext(f) + ".idx", fdidx, segments, offset);
+    }
+    if (fdout >= 0 && close(fdout) && err.empty())
+        err = "Error writing output data file";
+    if (fdidx >= 0 && close(fdidx) && err.empty())
+        err = "Error writing output index";
+    return err;
+}
+
+// Inserts 2D MRFs as slices of a 3D MRF
+static string mrf_append(const vector<string> &inputs, const string &output, uint64_t zsize,
+    uint64_t slice)
+{
+    string ext = extension(output);
+    string oname = basename_noext(output);
+    if (ext == ".mrf" || ext == ".idx")
+        return "Takes data file names as arguments";
+    for (auto &f : inputs)
+        if (extension(f) != ext)
+            return "All input files should have the same extension as the output";
+
+    // Get the template mrf information from the first input
+    string xml;
+    mrf_info info;
+    if (!read_file(basename_noext(inputs[0]) + ".mrf", xml))
+        return "Can't read " + basename_noext(inputs[0]) + ".mrf";
+    string err = get_mrf_info(xml, info);
+    if (!err.empty())
+        return err;
+
+    // Create the output .mrf if it doesn't exist
+    if (!exists(oname + ".mrf")) {
+        set_attr(xml, find_tag(xml, "Size", find_tag(xml, "Raster")), "z", to_string(zsize));
+        if (!write_file(oname + ".mrf", xml))
+            return "Can't write " + oname + ".mrf";
+    }
+
+    uint64_t inidxsize = info.totalpages * sizeof(tinfo);
+    uint64_t outidxsize = zsize * inidxsize;
+    // Make sure the output index is the right size
+    int64_t cursize = file_size(oname + ".idx");
+    if (cursize > int64_t(outidxsize))
+        return "Output index file exists and has the wrong size";
+    int fdidx = open((oname + ".idx").c_str(), O_RDWR | O_CREAT, 0644);
+    if (fdidx < 0 || ftruncate(fdidx, outidxsize)) {
+        if (fdidx >= 0)
+            close(fdidx);
+        return "Can't create output index";
+    }
+    int fdout = open(output.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fdout < 0) {
+        close(fdidx);
+        return "Can't open output data file";
+    }
+
+    for (auto &f : inputs) {
+        if (slice >= zsize) {
+            err = "Too many inputs for the output z size";
+            break;
+        }
+        string fname = basename_noext(f);
+        if (file_size(fname + ".idx") != int64_t(inidxsize)) {
+            err = "Index for file " + f + " has invalid size, expected " + to_string(inidxsize);
+            break;
+        }
+        cout << "Processing " << f << endl;
+        uint64_t offset;
+        err = append_data(f, fdout, offset);
+        if (!err.empty())
+            break;
+        // Each level of the input goes in its slice of the same level of the output
+        vector<segment> segments;
+        uint64_t start = 0;
+        for (auto p : info.pages) {
+            segments.push_back({start, p, start * zsize + slice * p});
+            start += p;
+        }
+        err = rebase_index(fname + ".idx", fdidx, segments, offset);
+        if (!err.empty())
+            break;
+        slice++;
+    }
+    if (close(fdout) && err.empty())
+        err = "Error writing output data file";
+    if (close(fdidx) && err.empty())
+        err = "Error writing output index";
+    return err;
+}
+
+int main(int argc, char **argv) {
+    string output;
+    bool forced = false;
+    uint64_t forceoffset = 0;
+    int64_t zsize = -1;
+    uint64_t slice = 0;
+    vector<string> names;
+    for (int i = 1; i < argc; i++) {
+        string arg(argv[i]);
+        if (arg.size() > 1 && arg[0] == '-' && i + 1 == argc)
+            return Usage("Option " + arg + " needs a value");
+        if (arg == "-o")
+            output = argv[++i];
+        else if (arg == "-z")
+            zsize = strtoll(argv[++i], nullptr, 0);
+        else if (arg == "-s")
+            slice = strtoull(argv[++i], nullptr, 0);
+        else if (arg == "-f") {
+            forced = true;
+            forceoffset = strtoull(argv[++i], nullptr, 0);
+        }
+        else if (arg.size() > 1 && arg[0] == '-')
+            return Usage("Unknown option " + arg);
+        else
+            names.push_back(arg);
+    }
+
+    string err;
+    if (zsize >= 0) {
+        if (output.empty())
+            return Usage("-z option requires an explicit output file name");
+        if (forced)
+            return Usage("-z option can't use a forced offset");
+        if (zsize < 1)
+            return Usage("Invalid z size");
+        if (names.empty())
+            return Usage("Needs at least one input");
+        err = mrf_append(names, output, zsize, slice);
+    }
+    else {
+        if (!output.empty())
+            names.push_back(output);
+        if (names.size() < 2)
+            return Usage("Takes a list of input MRF data files, the last is the output");
+        if (forced && names.size() != 2)
+            return Usage("Forced offset works only with one input");
+        err = mrf_join(names, forced, forceoffset);
+    }
+    if (!err.empty())
+        return Usage(err);
+    return 0;
+}
@@ -0,0 +1,159 @@
+/*
+ * file: mrf_meta.h
+ *
+ * File name helpers and minimal MRF metadata parsing, header only
+ *
+ * Only the parts of the .mrf file needed to locate the levels within the index are parsed,
+ * the raster size and page size and the uniform rset scale
+ *
+ */
+
+#if !defined(MRF_META_H)
+#define MRF_META_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+
+// File name without extension
+static inline std::string basename_noext(const std::string &name) {
+    auto dot = name.find_last_of('.');
+    auto slash = name.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return name;
+    return name.substr(0, dot);
+}
+
+static inline std::string extension(const std::string &name) {
+    return name.substr(basename_noext(name).size());
+}
+
+static inline bool read_file(const std::string &name, std::string &content) {
+    std::ifstream f(name, std::ios::binary);
+    if (!f)
+        return false;
+    std::stringstream ss;
+    ss << f.rdbuf();
+    content = ss.str();
+    return true;
+}
+
+//
+// Minimal MRF metadata parsing, only what is needed to locate the levels in the index
+//
+
+// Returns the start of the first tag with the given name, after pos, or npos
+static inline size_t find_tag(const std::string &xml, const std::string &name, size_t pos = 0) {
+    std::string open("<" + name);
+    for (pos = xml.find(open, pos); pos != std::string::npos; pos = xml.find(open, pos + 1)) {
+        char c = xml[pos + open.size()];
+        if (isspace(static_cast<unsigned char>(c)) || c == '/' || c == '>')
+            return pos;
+    }
+    return std::string::npos;
+}
+
+// Value of a tag attribute, or empty
+static inline std::string get_attr(const std::string &xml, size_t tag, const std::string &name) {
+    size_t end = xml.find('>', tag);
+    for (size_t pos = xml.find(name, tag); pos < end; pos = xml.find(name, pos + 1)) {
+        size_t eq = pos + name.size();
+        while (eq < end && isspace(static_cast<unsigned char>(xml[eq])))
+            eq++;
+        if (!isspace(static_cast<unsigned char>(xml[pos - 1])) || eq >= end || xml[eq] != '=')
+            continue;
+        size_t q = xml.find_first_of("\"'", eq);
+        if (q >= end)
+            return std::string();
+        size_t qe = xml.find(xml[q], q + 1);
+        return xml.substr(q + 1, qe - q - 1);
+    }
+    return std::string();
+}
+
+// Set the value of an attribute, adding it if needed
+static inline void set_attr(std::string &xml, size_t tag, const std::string &name, const std::string &value) {
+    size_t end = xml.find('>', tag);
+    if (end != std::string::npos && xml[end - 1] == '/')
+        end--;
+    while (end > tag && isspace(static_cast<unsigned char>(xml[end - 1])))
+        end--;
+    for (size_t pos = xml.find(name, tag); pos < end; pos = xml.find(name, pos + 1)) {
+        size_t eq = pos + name.size();
+        if (!isspace(static_cast<unsigned char>(xml[pos - 1])) || xml[eq] != '=')
+            continue;
+        size_t q = xml.find_first_of("\"'", eq);
+        size_t qe = xml.find(xml[q], q + 1);
+        xml.replace(q + 1, qe - q - 1, value);
+        return;
+    }
+    xml.insert(end, " " + name + "=\"" + value + "\"");
+}
+
+static inline uint64_t rupdiv(uint64_t x, uint64_t y) {
+    return (x + y - 1) / y;
+}
+
+struct mrf_info {
+    std::vector<uint64_t> pages; // Index entries per level, for one slice
+    uint64_t totalpages;
+    uint64_t zsize; // Slices, the index holds zsize * pages entries for each level
+};
+
+// Entries per level of the index
+static inline std::string get_mrf_info(const std::string &xml, mrf_info &info) {
+    size_t raster = find_tag(xml, "MRF_META");
+    if (raster == std::string::npos)
+        return "Not an MRF";
+    raster = find_tag(xml, "Raster", raster);
+    size_t tsize = find_tag(xml, "Size", raster);
+    if (raster == std::string::npos || tsize == std::string::npos)
+        return "MRF has no Raster/Size";
+    auto value = [&](size_t tag, const char *name, uint64_t dflt) {
+        std::string v = get_attr(xml, tag, name);
+        return v.empty() ? dflt : strtoull(v.c_str(), nullptr, 0);
+    };
+    uint64_t x = value(tsize, "x", 0), y = value(tsize, "y", 0), c = value(tsize, "c", 1);
+    info.zsize = value(tsize, "z", 1);
+    if (!x || !y || !c || !info.zsize)
+        return "Invalid MRF size";
+    uint64_t px = 512, py = 512, pc = c;
+    size_t tpsize = find_tag(xml, "PageSize", raster);
+    size_t rend = xml.find("</Raster", raster);
+    if (tpsize != std::string::npos && tpsize < rend) {
+        px = value(tpsize, "x", px);
+        py = value(tpsize, "y", py);
+        pc = value(tpsize, "c", pc);
+    }
+    if (!px || !py || !pc)
+        return "Invalid MRF page size";
+
+    uint64_t scale = 0;
+    size_t rsets = find_tag(xml, "Rsets");
+    if (rsets != std::string::npos) {
+        std::string model = get_attr(xml, rsets, "model");
+        if (!model.empty() && model != "uniform")
+            return "Only uniform model rsets are supported";
+        scale = value(rsets, "scale", 2);
+        if (scale < 2)
+            return "Invalid rset scale";
+    }
+
+    info.pages.assign(1, rupdiv(x, px) * rupdiv(y, py) * rupdiv(c, pc));
+    uint64_t bandpages = rupdiv(c, pc);
+    while (scale && info.pages.back() != bandpages) {
+        x = rupdiv(x, scale);
+        y = rupdiv(y, scale);
+        info.pages.push_back(rupdiv(x, px) * rupdiv(y, py) * rupdiv(c, pc));
+    }
+    info.totalpages = 0;
+    for (auto p : info.pages)
+        info.totalpages += p;
+    return std::string();
+}
+
+#endif
@@ -0,0 +1,289 @@
+/*
+ * file: mrf_stats.cpp
+ *
+ * Statistics of an MRF index, to help decide when an MRF needs compacting with mrf_clean
+ *
+ * mrf_stats [-m file.mrf] [-d data_file] <index_file>
+ *
+ * The index is either a normal MRF index, which is memory mapped and only the allocated
+ * regions are scanned, or a canned index (.ix), for which only the stored blocks are read.
+ * The index is scanned once, in order. It reports:
+ *  - The number of tiles, per level when the .mrf file is available
+ *  - The live bytes, covered by at least one tile, and the dead bytes, not used by any tile
+ *  - The tile size histogram, in powers of two
+ *  - The read locality, how many tiles are stored right after the previous tile of the
+ *    same level, so that reading the tiles in index order reads the data file sequentially
+ *
+ * The .mrf defaults to the index name with the .mrf extension, if it exists. The data file
+ * defaults to the DataFile from the .mrf. Without the data file size, dead bytes are counted
+ * up to the end of the last tile.
+ *
+ */
+
+#include "mrf_index.h"
+#include "mrf_meta.h"
+#include "canned_index.h"
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <functional>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+const static int BUFSZ(1024 * 1024); // Canned read chunk
+
+int Usage(const string &s) {
+    cerr << s << endl << endl
+    << "Synopsis: mrf_stats [OPTIONS] <index file>\n"
+    << "\tThe index file can be an MRF index or a canned index\n"
+    << "\t-m name\tMRF metadata file, for the per level counts, defaults to the index name with .mrf\n"
+    << "\t-d name\tData file, for the dead space, defaults to the DataFile from the .mrf\n";
+    return 1;
+}
+
+// Called for every non-zero index entry, in order, with the entry number and the host order value
+typedef function<void (uint64_t, const tinfo &)> visit_fn;
+
+static void visit_block(const tinfo *entries, size_t n, uint64_t first, const visit_fn &visit) {
+    for (size_t i = 0; i < n; i++) {
+        if (!entries[i].offset && !entries[i].size)
+            continue;
+        tinfo t = entries[i];
+        t.toh();
+        visit(first + i, t);
+    }
+}
+
+// Scan a normal index, mapping it and reading only the allocated parts
+static string scan_index(const string &name, uint64_t &isize, const visit_fn &visit) {
+    FILE *f = fopen(name.c_str(), "rb");
+    if (!f)
+        return "Can't open " + name;
+    FSEEK(f, 0, SEEK_END);
+    isize = FTELL(f);
+    auto ranges = allocated_ranges(f, isize);
+    string err;
+    if (isize >= sizeof(tinfo)) {
+        uint64_t msize = isize - isize % sizeof(tinfo);
+        void *p = mmap(nullptr, msize, PROT_READ, MAP_SHARED, fileno(f), 0);
+        if (MAP_FAILED == p) {
+            err = string("Can't mmap index, ") + strerror(errno);
+        }
+        else {
+            madvise(p, msize, MADV_SEQUENTIAL);
+            const tinfo *entries = reinterpret_cast<const tinfo *>(p);
+            for (auto &range : ranges) {
+                uint64_t start = range.start / sizeof(tinfo);
+                uint64_t end = min(range.end, msize) / sizeof(tinfo);
+                if (start < end)
+                    visit_block(entries + start, end - start, start, visit);
+            }
+            munmap(p, msize);
+        }
+    }
+    fclose(f);
+    return err;
+}
+
+// Scan a canned index, reading only the stored blocks
+static string scan_canned(const string &name, uint64_t &isize, const visit_fn &visit) {
+    CannedIndex idx;
+    string err = idx.open(name);
+    if (!err.empty())
+        return err;
+    isize = idx.size();
+    vector<tinfo> buffer(BUFSZ / sizeof(tinfo));
+    const uint64_t max_blocks = BUFSZ / canned::BSZ;
+    const uint64_t block_entries = canned::BSZ / sizeof(tinfo);
+    for (auto &run : idx.block_runs()) {
+        for (uint64_t b = run.first; b < run.first + run.second; b += max_blocks) {
+            uint64_t count = min(max_blocks, run.first + run.second - b);
+            if (!idx.read_blocks(b, count, buffer.data()))
+                return "Error reading canned index " + name;
+            uint64_t first = b * block_entries;
+            uint64_t n = min(count * block_entries, isize / sizeof(tinfo) - first);
+            visit_block(buffer.data(), n, first, visit);
+        }
+    }
+    return string();
+}
+
+static bool is_canned(const string &name) {
+    FILE *f = fopen(name.c_str(), "rb");
+    if (!f)
+        return false;
+    char sig[4] = {1};
+    bool canned = (1 == fread(sig, sizeof(sig), 1, f)) && !memcmp(sig, canned::SIG, 4);
+    fclose(f);
+    return canned;
+}
+
+static string percent(uint64_t part, uint64_t total) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.2f%%", total ? 100.0 * part / total : 0.0);
+    return buf;
+}
+
+int main(int argc, char **argv) {
+    string mrfname, dataname, idxname;
+    for (int i = 1; i < argc; i++) {
+        string arg(argv[i]);
+        if (arg == "-m" && i + 1 < argc)
+            mrfname = argv[++i];
+        else if (arg == "-d" && i + 1 < argc)
+            dataname = argv[++i];
+        else if (arg.size() > 1 && arg[0] == '-')
+            return Usage("Unknown option " + arg);
+        else if (idxname.empty())
+            idxname = arg;
+        else
+            return Usage("Only one index file can be given");
+    }
+    if (idxname.empty())
+        return Usage("Needs an index file name");
+
+    // Level layout, from the .mrf file
+    bool explicit_mrf = !mrfname.empty();
+    if (!explicit_mrf)
+        mrfname = basename_noext(idxname) + ".mrf";
+    mrf_info info;
+    string xml;
+    bool have_levels = false;
+    if (read_file(mrfname, xml)) {
+        string err = get_mrf_info(xml, info);
+        if (!err.empty() && explicit_mrf)
+            return Usage(mrfname + ": " + err);
+        have_levels = err.empty();
+        // Data file name, relative to the .mrf location
+        size_t tag = find_tag(xml, "DataFile");
+        if (dataname.empty() && tag != string::npos) {
+            size_t start = xml.find('>', tag) + 1;
+            size_t end = xml.find('<', start);
+            dataname = xml.substr(start, end - start);
+            dataname.erase(0, dataname.find_first_not_of(" \t\r\n"));
+            dataname.erase(dataname.find_last_not_of(" \t\r\n") + 1);
+            auto slash = mrfname.find_last_of("/\\");
+            if (!dataname.empty() && dataname[0] != '/' && slash != string::npos)
+                dataname = mrfname.substr(0, slash + 1) + dataname;
+        }
+    }
+    else if (explicit_mrf) {
+        return Usage("Can't read " + mrfname);
+    }
+
+    // Per level, first entry of each level and its counts
+    vector<uint64_t> level_start;
+    if (have_levels) {
+        uint64_t start = 0;
+        for (auto p : info.pages) {
+            level_start.push_back(start);
+            start += p * info.zsize;
+        }
+    }
+    vector<uint64_t> level_tiles(max<size_t>(1, level_start.size()), 0);
+    vector<uint64_t> histogram(65, 0);
+    vector<tinfo> extents;
+    uint64_t tiles = 0, referenced = 0, extra = 0;
+    uint64_t min_size = ~0ULL, max_size = 0;
+    uint64_t follows = 0, forward = 0, pairs = 0;
+    size_t level = 0;
+    tinfo prev = {0, 0};
+    uint64_t prev_level = ~0ULL;
+
+    visit_fn visit = [&](uint64_t n, const tinfo &t) {
+        if (!t.size) {
+            extra++; // Offset without a size, not a tile
+            return;
+        }
+        while (level + 1 < level_start.size() && n >= level_start[level + 1])
+            level++;
+        tiles++;
+        level_tiles[level]++;
+        referenced += t.size;
+        min_size = min(min_size, t.size);
+        max_size = max(max_size, t.size);
+        int bucket = 0;
+        while (bucket < 64 && (t.size >> (bucket + 1)))
+            bucket++;
+        histogram[bucket]++;
+        if (prev_level == level) {
+            pairs++;
+            if (t.offset == prev.offset + prev.size)
+                follows++;
+            if (t.offset >= prev.offset + prev.size)
+                forward++;
+        }
+        prev = t;
+        prev_level = level;
+        extents.push_back(t);
+    };
+
+    uint64_t isize = 0;
+    string err = is_canned(idxname) ? scan_canned(idxname, isize, visit)
+        : scan_index(idxname, isize, visit);
+    if (!err.empty())
+        return Usage(err);
+    if (have_levels && isize != info.totalpages * info.zsize * sizeof(tinfo))
+        cerr << "Warning: index size does not match " << mrfname << ", level counts are not reliable\n";
+
+    // Bytes covered by tiles, identical or overlapping tiles count once
+    sort(extents.begin(), extents.end());
+    uint64_t live = 0, end = 0, shared = 0;
+    for (size_t i = 0; i < extents.size(); i++) {
+        auto &t = extents[i];
+        if (i && t.offset == extents[i - 1].offset && t.size == extents[i - 1].size)
+            shared++;
+        uint64_t tend = t.offset + t.size;
+        if (tend > end) {
+            live += tend - max(t.offset, end);
+            end = tend;
+        }
+    }
+
+    int64_t dsize = -1;
+    struct stat statb;
+    if (!dataname.empty() && 0 == stat(dataname.c_str(), &statb))
+        dsize = statb.st_size;
+    else if (!dataname.empty())
+        cerr << "Warning: can't stat data file " << dataname << endl;
+    uint64_t total = dsize >= 0 ? max<uint64_t>(dsize, end) : end;
+
+    cout << "Index size: " << isize << " bytes, " << isize / sizeof(tinfo) << " entries\n";
+    cout << "Tiles: " << tiles << ", shared: " << shared;
+    if (extra)
+        cout << ", entries without size: " << extra;
+    cout << endl;
+    if (have_levels) {
+        for (size_t l = 0; l < level_tiles.size(); l++)
+            cout << "Level " << l << ": " << level_tiles[l] << " of " << info.pages[l] * info.zsize
+                << " (" << percent(level_tiles[l], info.pages[l] * info.zsize) << ")\n";
+    }
+    if (dsize >= 0)
+        cout << "Data file: " << dataname << ", " << dsize << " bytes\n";
+    else
+        cout << "Data file size unknown, using the end of the last tile, " << end << " bytes\n";
+    cout << "Live bytes: " << live << " (" << percent(live, total) << ")\n";
+    cout << "Dead bytes: " << total - live << " (" << percent(total - live, total) << ")\n";
+    cout << "Referenced bytes: " << referenced << endl;
+    if (tiles) {
+        cout << "Tile size: min " << min_size << ", average " << referenced / tiles
+            << ", max " << max_size << endl;
+        cout << "Tile size histogram:\n";
+        for (int b = 0; b < 64; b++)
+            if (histogram[b])
+                cout << "\t" << (1ULL << b) << " - " << ((2ULL << b) - 1) << ": " << histogram[b] << endl;
+    }
+    if (pairs)
+        cout << "Locality: " << percent(follows, pairs) << " of the tiles follow the previous one, "
+            << percent(forward, pairs) << " are stored after it\n";
+    return 0;
+}
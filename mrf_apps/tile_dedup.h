@@ -0,0 +1,131 @@
+/*
+ * file: tile_dedup.h
+ *
+ * Content hash and lookup table for finding identical tiles, header only
+ *
+ * The hash is xxHash64, fast and good enough to make false matches rare.
+ * The table is keyed by hash and tile size, matches are confirmed by the caller,
+ * usually by comparing the tile content, so a hash collision never merges different tiles
+ *
+ */
+
+#if !defined(TILE_DEDUP_H)
+#define TILE_DEDUP_H
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// 64 bit content hash, xxHash64
+static inline uint64_t hash64(const void *data, size_t len, uint64_t seed = 0) {
+    const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint64_t P3 = 0x165667B19E3779F9ULL;
+    const uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+    const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+    auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+    auto round = [&](uint64_t acc, uint64_t v) { return rotl(acc + v * P2, 31) * P1; };
+    auto merge = [&](uint64_t acc, uint64_t v) { return (acc ^ round(0, v)) * P1 + P4; };
+    // Unaligned little endian loads
+    auto rd64 = [](const uint8_t *p) {
+        uint64_t v = 0;
+        for (int i = 7; i >= 0; i--)
+            v = (v << 8) | p[i];
+        return v;
+    };
+    auto rd32 = [](const uint8_t *p) {
+        return uint64_t(p[0]) | uint64_t(p[1]) << 8 | uint64_t(p[2]) << 16 | uint64_t(p[3]) << 24;
+    };
+
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(data);
+    const uint8_t *end = p + len;
+    uint64_t h;
+    if (len >= 32) {
+        uint64_t v1 = seed + P1 + P2, v2 = seed + P2, v3 = seed, v4 = seed - P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round(v1, rd64(p));
+            v2 = round(v2, rd64(p + 8));
+            v3 = round(v3, rd64(p + 16));
+            v4 = round(v4, rd64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge(merge(merge(merge(h, v1), v2), v3), v4);
+    }
+    else {
+        h = seed + P5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8)
+        h = rotl(h ^ round(0, rd64(p)), 27) * P1 + P4;
+    if (p + 4 <= end) {
+        h = rotl(h ^ (rd32(p) * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl(h ^ (*p * P5), 11) * P1;
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Open addressing table of known tiles, keyed by content hash and size
+// Each tile has a location, where the caller can read it from, and an output offset
+class dedup_table {
+public:
+    dedup_table() : used(0), slots(1024) {}
+
+    // Looks for a tile with the same hash and size, for which same(location) returns true
+    // Returns true and sets the output offset if found
+    template<typename F> bool find(uint64_t hash, uint64_t size, F same, uint64_t &offset) const {
+        for (size_t i = hash & (slots.size() - 1); slots[i].size; i = (i + 1) & (slots.size() - 1)) {
+            auto &s = slots[i];
+            if (s.hash == hash && s.size == size && same(s.location)) {
+                offset = s.offset;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Adds a tile, size has to be non zero
+    void insert(uint64_t hash, uint64_t size, uint64_t location, uint64_t offset) {
+        if (2 * (used + 1) > slots.size())
+            grow();
+        place({hash, size, location, offset});
+        used++;
+    }
+
+    size_t count() const { return used; }
+
+private:
+    struct slot {
+        uint64_t hash;
+        uint64_t size; // Zero for an empty slot
+        uint64_t location;
+        uint64_t offset;
+    };
+
+    void place(const slot &s) {
+        size_t i = s.hash & (slots.size() - 1);
+        while (slots[i].size)
+            i = (i + 1) & (slots.size() - 1);
+        slots[i] = s;
+    }
+
+    // Double the size, keeps the load under one half
+    void grow() {
+        std::vector<slot> old(slots.size() * 2);
+        old.swap(slots);
+        for (auto &s : old)
+            if (s.size)
+                place(s);
+    }
+
+    size_t used;
+    std::vector<slot> slots;
+};
+
+#endif